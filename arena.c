@@ -0,0 +1,73 @@
+/*****************************************************************
+ # arena.c: Bump allocator
+ *****************************************************************
+ * libhx2: library for reading and writing .hx audio files
+ * Copyright (c) 2024 Jba03 <jba03@jba03.xyz>
+ *****************************************************************/
+
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_MIN_BLOCK_SIZE 0x10000
+#define ARENA_MAX_BLOCK_SIZE 0x400000
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size, used;
+};
+
+/* block data follows the header, padded so that it is aligned */
+#define ARENA_HEADER_SIZE ((sizeof(struct arena_block) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+void arena_init(struct arena *arena) {
+  arena->head = NULL;
+  arena->block_size = ARENA_MIN_BLOCK_SIZE;
+}
+
+void* arena_alloc(struct arena *arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  
+  struct arena_block *block = arena->head;
+  if (!block || block->size - block->used < size) {
+    /* blocks grow geometrically, so a large file needs few of them */
+    size_t block_size = arena->block_size;
+    if (block_size < size) block_size = size;
+    if (!(block = malloc(ARENA_HEADER_SIZE + block_size))) return NULL;
+    block->size = block_size;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+    if (arena->block_size < ARENA_MAX_BLOCK_SIZE) arena->block_size *= 2;
+  }
+  
+  void* p = (unsigned char*)block + ARENA_HEADER_SIZE + block->used;
+  block->used += size;
+  return p;
+}
+
+void arena_merge(struct arena *arena, struct arena *other) {
+  struct arena_block *tail = other->head;
+  if (!tail) return;
+  while (tail->next) tail = tail->next;
+  
+  /* keep allocating from the current block of `arena` */
+  if (arena->head) {
+    tail->next = arena->head->next;
+    arena->head->next = other->head;
+  } else {
+    arena->head = other->head;
+  }
+  arena_init(other);
+}
+
+void arena_free(struct arena *arena) {
+  struct arena_block *block = arena->head;
+  while (block) {
+    struct arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena_init(arena);
+}
@@ -0,0 +1,38 @@
+/*****************************************************************
+ # arena.h: Bump allocator
+ *****************************************************************
+ * libhx2: library for reading and writing .hx audio files
+ * Copyright (c) 2024 Jba03 <jba03@jba03.xyz>
+ *****************************************************************/
+
+#ifndef arena_h
+#define arena_h
+
+#include <stddef.h>
+
+struct arena_block;
+
+struct arena {
+  struct arena_block *head;
+  /** Size of the next block */
+  size_t block_size;
+};
+
+/** arena_init:
+ * Initialize an empty arena. */
+void arena_init(struct arena *arena);
+
+/** arena_alloc:
+ * Allocate `size` bytes, aligned for any type. The memory
+ * is only released by arena_free. Returns NULL on failure. */
+void* arena_alloc(struct arena *arena, size_t size);
+
+/** arena_merge:
+ * Move all memory of `other` into `arena`, leaving `other` empty. */
+void arena_merge(struct arena *arena, struct arena *other);
+
+/** arena_free:
+ * Release all memory allocated from the arena. */
+void arena_free(struct arena *arena);
+
+#endif /* arena_h */
@@ -0,0 +1,156 @@
+/*****************************************************************
+ # open.c: Time hx_context_open on synthetic contexts
+ *****************************************************************
+ * libhx2: library for reading and writing .hx audio files
+ * Copyright (c) 2024 Jba03 <jba03@jba03.xyz>
+ *****************************************************************/
+
+/* the synthetic contexts are built from the context internals */
+#include "../hx2.c"
+
+/** Number of event -> resource -> wave file chains of the smallest context */
+#define BENCH_MIN_CHAINS 1000
+/** Number of doublings of the context size */
+#define BENCH_STEPS 7
+/** Best of this many opens is reported */
+#define BENCH_REPEAT 5
+/** Samples of every internal wave file */
+#define BENCH_SAMPLES 32
+
+/** The file written by hx_context_write, read back by hx_context_open */
+static struct {
+  char *data;
+  size_t size;
+} bench_file;
+
+static char* bench_read(const char* filename, size_t pos, size_t *size, void* userdata) {
+  if (pos > bench_file.size) return NULL;
+  if (*size > bench_file.size - pos) *size = bench_file.size - pos;
+  char *data = malloc(*size ? *size : 1);
+  if (data) memcpy(data, bench_file.data + pos, *size);
+  return data;
+}
+
+static void bench_write(const char* filename, void* data, size_t pos, size_t *size, void* userdata) {
+  if (pos + *size > bench_file.size) {
+    char *grown = realloc(bench_file.data, pos + *size);
+    if (!grown) {
+      *size = 0;
+      return;
+    }
+    bench_file.data = grown;
+    bench_file.size = pos + *size;
+  }
+  memcpy(bench_file.data + pos, data, *size);
+}
+
+static void bench_error(const char* error_str, void* userdata) {
+  fprintf(stderr, "%s\n", error_str);
+}
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+static HX_CUUID bench_cuuid(enum HX_Class c, unsigned int n) {
+  return ((HX_CUUID)(c + 1) << 32) | n;
+}
+
+/**
+ * Build a context of `num_chains` EventResData -> WavResData -> WaveFileIdObj chains,
+ * so that opening it resolves two links per chain.
+ */
+static HX_Context *bench_context(unsigned int num_chains) {
+  HX_Context *hx = hx_context_alloc();
+  hx_context_callback(hx, bench_read, bench_write, bench_error, NULL);
+  hx->stream.endianness = HX_BIG_ENDIAN;
+  hx->num_entries = num_chains * 3;
+  hx->entries = calloc(hx->num_entries, sizeof(HX_Entry));
+  
+  for (unsigned int n = 0; n < num_chains; n++) {
+    HX_Entry *event = hx->entries + n;
+    HX_Entry *resource = hx->entries + num_chains + n;
+    HX_Entry *wave = hx->entries + 2 * num_chains + n;
+    hx_entry_init(event);
+    hx_entry_init(resource);
+    hx_entry_init(wave);
+    
+    HX_EventResData *event_data = calloc(1, sizeof(*event_data));
+    snprintf(event_data->name, HX_STRING_MAX_LENGTH, "Play_bench_%u", n);
+    event_data->link = bench_cuuid(HX_CLASS_WAVE_RESOURCE_DATA, n);
+    event->i_cuuid = bench_cuuid(HX_CLASS_EVENT_RESOURCE_DATA, n);
+    event->i_class = HX_CLASS_EVENT_RESOURCE_DATA;
+    event->p_data = event_data;
+    
+    HX_WavResData *resource_data = calloc(1, sizeof(*resource_data));
+    resource_data->res_data.flags = HX_WAVRES_OBJ_FLAG_MULTIPLE;
+    resource_data->num_links = 1;
+    resource_data->links = calloc(1, sizeof(*resource_data->links));
+    resource_data->links[0].cuuid = bench_cuuid(HX_CLASS_WAVE_FILE_ID_OBJECT, n);
+    resource_data->links[0].language = HX_LANGUAGE_EN;
+    resource->i_cuuid = event_data->link;
+    resource->i_class = HX_CLASS_WAVE_RESOURCE_DATA;
+    resource->p_data = resource_data;
+    
+    HX_WaveFileIdObj *wave_data = calloc(1, sizeof(*wave_data));
+    struct waveformat_header *header = malloc(sizeof(*header));
+    waveformat_default_header(header);
+    header->riff_length = sizeof(*header) - 8;
+    wave_data->_wave_header = header;
+    wave_data->audio_stream = malloc(sizeof(HX_AudioStream));
+    hx_audio_stream_init(wave_data->audio_stream);
+    wave_data->audio_stream->info.num_channels = 1;
+    wave_data->audio_stream->info.sample_rate = 22050;
+    wave_data->audio_stream->info.num_samples = BENCH_SAMPLES;
+    wave_data->audio_stream->size = BENCH_SAMPLES * sizeof(short);
+    wave_data->audio_stream->data = calloc(BENCH_SAMPLES, sizeof(short));
+    wave->i_cuuid = resource_data->links[0].cuuid;
+    wave->i_class = HX_CLASS_WAVE_FILE_ID_OBJECT;
+    wave->p_data = wave_data;
+  }
+  
+  return hx;
+}
+
+int main(int argc, char **argv) {
+  printf("%10s %12s %12s %14s\n", "entries", "file (KiB)", "open (ms)", "per entry (ns)");
+  
+  for (unsigned int step = 0, num_chains = BENCH_MIN_CHAINS; step < BENCH_STEPS; step++, num_chains *= 2) {
+    HX_Context *hx = bench_context(num_chains);
+    bench_file.size = 0;
+    const int written = hx_context_write(hx, "bench.hxg", HX_VERSION_HXG);
+    hx_context_free(&hx);
+    if (written != 0) {
+      fprintf(stderr, "failed to write the context of %u entries\n", num_chains * 3);
+      free(bench_file.data);
+      return 1;
+    }
+    
+    double best = 0.0;
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+      HX_Context *ctx = hx_context_alloc();
+      hx_context_callback(ctx, bench_read, bench_write, bench_error, NULL);
+      const double start = bench_now();
+      const int result = hx_context_open(ctx, "bench.hxg");
+      const double elapsed = bench_now() - start;
+      
+      if (result != 0 || hx_context_num_entries(ctx) != num_chains * 3) {
+        fprintf(stderr, "failed to open the context of %u entries\n", num_chains * 3);
+        hx_context_free(&ctx);
+        free(bench_file.data);
+        return 1;
+      }
+      
+      hx_context_free(&ctx);
+      if (r == 0 || elapsed < best) best = elapsed;
+    }
+    
+    const unsigned int num_entries = num_chains * 3;
+    printf("%10u %12zu %12.3f %14.1f\n", num_entries, bench_file.size / 1024, best * 1.0e3, best * 1.0e9 / num_entries);
+  }
+  
+  free(bench_file.data);
+  return 0;
+}
@@ -0,0 +1,245 @@
+/*****************************************************************
+ # cache.c: Decoded audio cache
+ *****************************************************************
+ * libhx2: library for reading and writing .hx audio files
+ * Copyright (c) 2024 Jba03 <jba03@jba03.xyz>
+ *****************************************************************/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "hx2.h"
+
+struct audio_cache_entry {
+  /** Key: wavefile and output format */
+  HX_CUUID cuuid;
+  enum HX_AudioFormat fmt;
+  unsigned int sample_rate;
+  unsigned int num_channels;
+  /** Converted stream */
+  HX_AudioStream stream;
+  /** Number of users holding the entry */
+  unsigned int pins;
+  /** Set on access, cleared by the clock hand */
+  int referenced;
+  /** Next entry in the hash bucket */
+  struct audio_cache_entry *next;
+  /** Neighbours in the clock ring */
+  struct audio_cache_entry *prev_clock, *next_clock;
+};
+
+struct HX_AudioCache {
+  pthread_mutex_t lock;
+  size_t budget;
+  struct audio_cache_entry **buckets;
+  unsigned int num_buckets;
+  /** Clock hand, or NULL if the cache is empty */
+  struct audio_cache_entry *hand;
+  HX_AudioCacheStats stats;
+};
+
+#define AUDIO_CACHE_MIN_BUCKETS 64
+
+static unsigned int audio_cache_hash(const struct audio_cache_entry *key, unsigned int num_buckets) {
+  unsigned long long h = key->cuuid * 0x9E3779B97F4A7C15ull;
+  h ^= ((unsigned long long)key->fmt << 40) ^ ((unsigned long long)key->num_channels << 32) ^ key->sample_rate;
+  h *= 0xBF58476D1CE4E5B9ull;
+  return (unsigned int)(h >> 32) & (num_buckets - 1);
+}
+
+static int audio_cache_key_equal(const struct audio_cache_entry *a, const struct audio_cache_entry *b) {
+  return a->cuuid == b->cuuid && a->fmt == b->fmt && a->sample_rate == b->sample_rate && a->num_channels == b->num_channels;
+}
+
+static struct audio_cache_entry *audio_cache_lookup(const HX_AudioCache *cache, const struct audio_cache_entry *key) {
+  struct audio_cache_entry *e = cache->buckets[audio_cache_hash(key, cache->num_buckets)];
+  while (e && !audio_cache_key_equal(e, key)) e = e->next;
+  return e;
+}
+
+/** Double the bucket count when the load factor exceeds one */
+static void audio_cache_grow(HX_AudioCache *cache) {
+  if (cache->stats.num_entries < cache->num_buckets) return;
+  
+  const unsigned int num_buckets = cache->num_buckets * 2;
+  struct audio_cache_entry **buckets = calloc(num_buckets, sizeof(*buckets));
+  if (!buckets) return; /* keep the longer chains */
+  
+  for (unsigned int i = 0; i < cache->num_buckets; i++) {
+    struct audio_cache_entry *e = cache->buckets[i], *next;
+    for (; e; e = next) {
+      next = e->next;
+      const unsigned int b = audio_cache_hash(e, num_buckets);
+      e->next = buckets[b];
+      buckets[b] = e;
+    }
+  }
+  
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->num_buckets = num_buckets;
+}
+
+static void audio_cache_insert(HX_AudioCache *cache, struct audio_cache_entry *e) {
+  const unsigned int b = audio_cache_hash(e, cache->num_buckets);
+  e->next = cache->buckets[b];
+  cache->buckets[b] = e;
+  
+  /* new entries go just behind the hand, so they are visited last */
+  if (cache->hand) {
+    e->next_clock = cache->hand;
+    e->prev_clock = cache->hand->prev_clock;
+    e->prev_clock->next_clock = e;
+    cache->hand->prev_clock = e;
+  } else {
+    e->next_clock = e->prev_clock = cache->hand = e;
+  }
+  
+  cache->stats.size += e->stream.size;
+  cache->stats.num_entries++;
+  audio_cache_grow(cache);
+}
+
+static void audio_cache_remove(HX_AudioCache *cache, struct audio_cache_entry *e) {
+  struct audio_cache_entry **p = &cache->buckets[audio_cache_hash(e, cache->num_buckets)];
+  while (*p != e) p = &(*p)->next;
+  *p = e->next;
+  
+  if (e->next_clock == e) {
+    cache->hand = NULL;
+  } else {
+    e->prev_clock->next_clock = e->next_clock;
+    e->next_clock->prev_clock = e->prev_clock;
+    if (cache->hand == e) cache->hand = e->next_clock;
+  }
+  
+  cache->stats.size -= e->stream.size;
+  cache->stats.num_entries--;
+  hx_audio_stream_dealloc(&e->stream);
+  free(e);
+}
+
+/** Evict unpinned entries in clock order until the cache fits its budget */
+static void audio_cache_evict(HX_AudioCache *cache) {
+  /* two sweeps clear every reference bit; stop if only pinned entries remain */
+  size_t steps = 2 * cache->stats.num_entries + 1;
+  while (cache->stats.size > cache->budget && cache->hand && steps--) {
+    struct audio_cache_entry *e = cache->hand;
+    cache->hand = e->next_clock;
+    if (e->pins > 0) continue;
+    if (e->referenced) {
+      e->referenced = 0;
+      continue;
+    }
+    audio_cache_remove(cache, e);
+    cache->stats.evictions++;
+    steps = 2 * cache->stats.num_entries + 1;
+  }
+}
+
+HX_AudioCache *hx_audio_cache_alloc(size_t budget) {
+  HX_AudioCache *cache = calloc(1, sizeof(*cache));
+  if (!cache) return NULL;
+  cache->budget = budget;
+  cache->num_buckets = AUDIO_CACHE_MIN_BUCKETS;
+  cache->buckets = calloc(cache->num_buckets, sizeof(*cache->buckets));
+  if (!cache->buckets || pthread_mutex_init(&cache->lock, NULL) != 0) {
+    free(cache->buckets);
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+void hx_audio_cache_set_budget(HX_AudioCache *cache, size_t budget) {
+  pthread_mutex_lock(&cache->lock);
+  cache->budget = budget;
+  audio_cache_evict(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+const HX_AudioStream *hx_audio_cache_acquire(HX_AudioCache *cache, const HX_AudioStream *in, const struct HX_AudioStreamInfo *out_info) {
+  if (in->info.wavefile_cuuid == 0) return NULL;
+  
+  struct audio_cache_entry key;
+  key.cuuid = in->info.wavefile_cuuid;
+  key.fmt = out_info->fmt;
+  key.sample_rate = out_info->sample_rate ? out_info->sample_rate : in->info.sample_rate;
+  key.num_channels = out_info->num_channels ? out_info->num_channels : in->info.num_channels;
+  
+  pthread_mutex_lock(&cache->lock);
+  struct audio_cache_entry *e = audio_cache_lookup(cache, &key);
+  if (e) {
+    e->pins++;
+    e->referenced = 1;
+    cache->stats.hits++;
+    pthread_mutex_unlock(&cache->lock);
+    return &e->stream;
+  }
+  cache->stats.misses++;
+  pthread_mutex_unlock(&cache->lock);
+  
+  /* convert without holding the lock */
+  struct audio_cache_entry *entry = malloc(sizeof(*entry));
+  if (!entry) return NULL;
+  *entry = key;
+  entry->pins = 1;
+  entry->referenced = 1;
+  hx_audio_stream_init(&entry->stream);
+  entry->stream.info = *out_info;
+  entry->stream.info.sample_rate = key.sample_rate;
+  entry->stream.info.num_channels = key.num_channels;
+  if (hx_audio_convert(in, &entry->stream) != 0) {
+    hx_audio_stream_dealloc(&entry->stream);
+    free(entry);
+    return NULL;
+  }
+  entry->stream.info.wavefile_cuuid = key.cuuid;
+  
+  pthread_mutex_lock(&cache->lock);
+  if ((e = audio_cache_lookup(cache, &key))) {
+    /* another thread converted the same stream meanwhile */
+    e->pins++;
+    e->referenced = 1;
+    pthread_mutex_unlock(&cache->lock);
+    hx_audio_stream_dealloc(&entry->stream);
+    free(entry);
+    return &e->stream;
+  }
+  audio_cache_insert(cache, entry);
+  audio_cache_evict(cache);
+  pthread_mutex_unlock(&cache->lock);
+  return &entry->stream;
+}
+
+void hx_audio_cache_release(HX_AudioCache *cache, const HX_AudioStream *stream) {
+  struct audio_cache_entry *e = (struct audio_cache_entry*)((char*)stream - offsetof(struct audio_cache_entry, stream));
+  pthread_mutex_lock(&cache->lock);
+  if (e->pins > 0 && --e->pins == 0) audio_cache_evict(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void hx_audio_cache_stats(HX_AudioCache *cache, HX_AudioCacheStats *stats) {
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void hx_audio_cache_clear(HX_AudioCache *cache) {
+  pthread_mutex_lock(&cache->lock);
+  const size_t budget = cache->budget;
+  cache->budget = 0;
+  audio_cache_evict(cache);
+  cache->budget = budget;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void hx_audio_cache_free(HX_AudioCache **cache) {
+  if (!*cache) return;
+  while ((*cache)->hand) audio_cache_remove(*cache, (*cache)->hand);
+  pthread_mutex_destroy(&(*cache)->lock);
+  free((*cache)->buckets);
+  free(*cache);
+  *cache = NULL;
+}
@@ -6,6 +6,14 @@
  *****************************************************************/
 
 #include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <time.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HX_X86 1
+#include <immintrin.h>
+#endif
 
 #define min(a,b) (((a)<(b))?(a):(b))
 #define max(a,b) (((a)>(b))?(a):(b))
@@ -16,6 +24,134 @@ static void audio_stream_info_copy(struct HX_AudioStreamInfo *dst, const struct
   memcpy(dst, src, sizeof(struct HX_AudioStreamInfo));
 }
 
+/** Mark the output of a conversion as owned by the stream or borrowed from the caller */
+static int audio_stream_converted(HX_AudioStream *out, int result, int borrowed) {
+  if (result == 0) {
+    /* a seek table copied along with the input stream belongs to the input */
+    out->_seek_table = NULL;
+    out->_borrowed = borrowed;
+    out->_release = NULL;
+    out->_release_userdata = NULL;
+  }
+  return result;
+}
+
+/** Encoder writing into a caller-supplied buffer of `cap` bytes */
+typedef int audio_encoder_into(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode, void *buf, HX_Size cap);
+
+/** Encode into a newly allocated buffer of `size` bytes. */
+static int audio_encode_alloc(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode, HX_Size size, audio_encoder_into *encode) {
+  void *buf = malloc(size ? size : 1);
+  if (!buf) return -1;
+  if (encode(in, out, mode, buf, size) != 0) {
+    free(buf);
+    out->data = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+#pragma mark - CPU
+
+#define HX_CPU_SSE2  (1 << 0)
+#define HX_CPU_SSSE3 (1 << 1)
+#define HX_CPU_AVX2  (1 << 2)
+
+/** Instruction set extensions available at runtime */
+static unsigned int hx_cpu_features(void) {
+  static int features = -1;
+  if (features < 0) {
+    int f = 0;
+#if HX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) f |= HX_CPU_SSE2;
+    if (__builtin_cpu_supports("ssse3")) f |= HX_CPU_SSSE3;
+    if (__builtin_cpu_supports("avx2")) f |= HX_CPU_AVX2;
+#endif
+    features = f;
+  }
+  return features;
+}
+
+#pragma mark - Decoder
+
+/**
+ * Destination of decoded samples. Sample s of channel c is stored at
+ * `s * stride + c * channel_stride`, either as s16 or as float in [-1, 1).
+ */
+struct audio_output {
+  void *dst;
+  HX_Size stride, channel_stride;
+  int f32;
+};
+
+static inline struct audio_output audio_output_interleaved(signed short *dst, unsigned int num_channels) {
+  return (struct audio_output){ dst, num_channels, 1, 0 };
+}
+
+/** Output of a single channel */
+static inline struct audio_output audio_output_channel(const struct audio_output *o, unsigned int c) {
+  struct audio_output r = *o;
+  r.dst = o->f32 ? (void*)((float*)o->dst + c * o->channel_stride) : (void*)((signed short*)o->dst + c * o->channel_stride);
+  return r;
+}
+
+/** Output starting `s` samples later */
+static inline struct audio_output audio_output_offset(const struct audio_output *o, HX_Size s) {
+  struct audio_output r = *o;
+  r.dst = o->f32 ? (void*)((float*)o->dst + s * o->stride) : (void*)((signed short*)o->dst + s * o->stride);
+  return r;
+}
+
+/** Store sample `s` of a single channel output, converting it in register. */
+static inline void audio_output_store(const struct audio_output *o, HX_Size s, signed int sample) {
+  if (o->f32) ((float*)o->dst)[s * o->stride] = sample * (1.0f / 32768.0f);
+  else ((signed short*)o->dst)[s * o->stride] = (signed short)sample;
+}
+
+struct HX_AudioDecoder {
+  /** Input stream */
+  const HX_AudioStream *stream;
+  /** Output stream info */
+  struct HX_AudioStreamInfo info;
+  /** Samples per channel in one codec frame */
+  unsigned int samples_per_frame;
+  /** Bytes per channel in one codec frame */
+  unsigned int bytes_per_frame;
+  /** First frame and end of the compressed data */
+  const unsigned char *src, *end;
+  /** Index of the next frame to decode */
+  HX_Size frame;
+  /** Decode the next frame, `count` samples per channel, into `dst` */
+  int (*decode)(HX_AudioDecoder *, const struct audio_output *dst, unsigned int count);
+  /** Sample format of hx_audio_decoder_read_samples */
+  enum HX_SampleFormat sample_format;
+  /** Interleaved samples of a partially read frame */
+  signed short *buffer;
+  unsigned int buffer_pos, buffer_len;
+  /** Per-channel codec state */
+  union {
+    struct dsp_adpcm *dsp;
+    struct psx_adpcm *psx;
+  } channels;
+  /** Loop region in samples (end exclusive), used if `loop` is set */
+  HX_Size loop_start, loop_end;
+  int loop, loop_saved;
+  /** Predictor history of every channel at the first frame of the loop, [channel][2] */
+  signed short *loop_history;
+};
+
+/** Compressed data of a channel in the current frame */
+static const unsigned char *audio_decoder_frame_data(const HX_AudioDecoder *d, unsigned int channel) {
+  return d->src + (d->frame * d->info.num_channels + channel) * d->bytes_per_frame;
+}
+
+/** Decode the next frame as interleaved s16 */
+static int audio_decoder_decode(HX_AudioDecoder *d, signed short *dst, unsigned int count) {
+  const struct audio_output out = audio_output_interleaved(dst, d->info.num_channels);
+  return d->decode(d, &out, count);
+}
+
 #pragma mark - DSP ADPCM
 
 #define DSP_HEADER_SIZE 96
@@ -65,13 +201,6 @@ static int dsp_nibble_address(int sample) {
   return DSP_NIBBLES_PER_FRAME * frames + extra_samples + 2;
 }
 
-static int dsp_byte_count(int samples) {
-  int frames = samples / DSP_SAMPLES_PER_FRAME, extra_bytes = 0;
-  int extra_samples = samples % DSP_SAMPLES_PER_FRAME;
-  if (extra_samples != 0) extra_bytes = (extra_samples / 2) + (extra_samples % 2) + 1;
-  return DSP_BYTES_PER_FRAME * frames + extra_bytes;
-}
-
 /** Size of decoded dsp stream */
 static HX_Size dsp_pcm_size(const HX_Size sample_count) {
   unsigned int frames = sample_count / DSP_SAMPLES_PER_FRAME;
@@ -79,148 +208,696 @@ static HX_Size dsp_pcm_size(const HX_Size sample_count) {
   return frames * DSP_SAMPLES_PER_FRAME * sizeof(short);
 }
 
-static int dsp_decode(const HX_AudioStream *in, HX_AudioStream *out) {
+/**
+ * Decode a single frame of one channel. `frame` must point to 8 readable bytes,
+ * `count` is the number of samples (<= 14) to write to the channel output `dst`.
+ */
+typedef void (*dsp_frame_decoder)(const unsigned char *frame, struct dsp_adpcm *adpcm, const struct audio_output *dst, int count);
+
+static void dsp_frame_decode_scalar(const unsigned char *frame, struct dsp_adpcm *adpcm, const struct audio_output *dst, int count) {
+  const unsigned char *src = frame + 1;
+  const signed int predictor = (frame[0] >> 4) & 0x7;
+  const signed int scale = 1 << (frame[0] & 0xF);
+  const signed short c1 = adpcm->c[predictor * 2 + 0];
+  const signed short c2 = adpcm->c[predictor * 2 + 1];
+  
+  signed int hst1 = adpcm->history1;
+  signed int hst2 = adpcm->history2;
+  
+  for (int s = 0; s < count; s++) {
+    int sample = (s % 2) == 0 ? ((*src >> 4) & 0xF) : (*src++ & 0xF);
+    sample = sample >= 8 ? sample - 16 : sample;
+    sample = (((scale * sample) << 11) + 1024 + (c1*hst1 + c2*hst2)) >> 11;
+    if (sample < SHRT_MIN) sample = SHRT_MIN;
+    if (sample > SHRT_MAX) sample = SHRT_MAX;
+    hst2 = hst1;
+    audio_output_store(dst, s, hst1 = sample);
+  }
+  
+  adpcm->history1 = hst1;
+  adpcm->history2 = hst2;
+}
+
+#if HX_X86
+/**
+ * Run the predictor over a frame of pre-scaled residuals, `((scale * nibble) << 11) + 1024`.
+ * The history feedback is serial, so only the unpacking before this point is vectorized.
+ */
+static inline void dsp_frame_filter(const signed int *excitation, struct dsp_adpcm *adpcm, signed int predictor, const struct audio_output *dst, int count) {
+  const signed int c1 = adpcm->c[predictor * 2 + 0];
+  const signed int c2 = adpcm->c[predictor * 2 + 1];
+  signed int hst1 = adpcm->history1;
+  signed int hst2 = adpcm->history2;
+  
+  for (int s = 0; s < count; s++) {
+    signed int sample = (excitation[s] + (c1*hst1 + c2*hst2)) >> 11;
+    sample = sample < SHRT_MIN ? SHRT_MIN : sample;
+    sample = sample > SHRT_MAX ? SHRT_MAX : sample;
+    hst2 = hst1;
+    audio_output_store(dst, s, hst1 = sample);
+  }
+  
+  adpcm->history1 = hst1;
+  adpcm->history2 = hst2;
+}
+
+__attribute__((target("sse2")))
+static void dsp_frame_decode_sse2(const unsigned char *frame, struct dsp_adpcm *adpcm, const struct audio_output *dst, int count) {
+  signed int excitation[16];
+  const __m128i mask = _mm_set1_epi8(0x0F), eight = _mm_set1_epi8(8);
+  const __m128i bytes = _mm_srli_si128(_mm_loadl_epi64((const __m128i*)frame), 1);
+  /* high nibble first, then sign-extend the 4-bit values to 8 bits */
+  __m128i nibbles = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(bytes, 4), mask), _mm_and_si128(bytes, mask));
+  nibbles = _mm_sub_epi8(_mm_xor_si128(nibbles, eight), eight);
+  
+  const __m128i sign = _mm_cmpgt_epi8(_mm_setzero_si128(), nibbles);
+  const __m128i n[2] = { _mm_unpacklo_epi8(nibbles, sign), _mm_unpackhi_epi8(nibbles, sign) };
+  const __m128i shift = _mm_cvtsi32_si128((frame[0] & 0xF) + 11);
+  const __m128i bias = _mm_set1_epi32(1024);
+  for (int i = 0; i < 2; i++) {
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(n[i], n[i]), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(n[i], n[i]), 16);
+    _mm_storeu_si128((__m128i*)(excitation + i * 8 + 0), _mm_add_epi32(_mm_sll_epi32(lo, shift), bias));
+    _mm_storeu_si128((__m128i*)(excitation + i * 8 + 4), _mm_add_epi32(_mm_sll_epi32(hi, shift), bias));
+  }
+  
+  dsp_frame_filter(excitation, adpcm, (frame[0] >> 4) & 0x7, dst, count);
+}
+
+__attribute__((target("ssse3")))
+static void dsp_frame_decode_ssse3(const unsigned char *frame, struct dsp_adpcm *adpcm, const struct audio_output *dst, int count) {
+  signed int excitation[16];
+  const __m128i bytes = _mm_loadl_epi64((const __m128i*)frame);
+  /* place each data byte in the upper half of two 16-bit lanes, move the low
+   * nibble of odd lanes to the top and sign-extend with an arithmetic shift */
+  const __m128i index0 = _mm_setr_epi8(-1, 1, -1, 1, -1, 2, -1, 2, -1, 3, -1, 3, -1, 4, -1, 4);
+  const __m128i index1 = _mm_setr_epi8(-1, 5, -1, 5, -1, 6, -1, 6, -1, 7, -1, 7, -1, -1, -1, -1);
+  const __m128i select = _mm_setr_epi16(1, 16, 1, 16, 1, 16, 1, 16);
+  const __m128i n[2] = {
+    _mm_srai_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(bytes, index0), select), 12),
+    _mm_srai_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(bytes, index1), select), 12),
+  };
+  const __m128i shift = _mm_cvtsi32_si128((frame[0] & 0xF) + 11);
+  const __m128i bias = _mm_set1_epi32(1024);
+  for (int i = 0; i < 2; i++) {
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(n[i], n[i]), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(n[i], n[i]), 16);
+    _mm_storeu_si128((__m128i*)(excitation + i * 8 + 0), _mm_add_epi32(_mm_sll_epi32(lo, shift), bias));
+    _mm_storeu_si128((__m128i*)(excitation + i * 8 + 4), _mm_add_epi32(_mm_sll_epi32(hi, shift), bias));
+  }
+  
+  dsp_frame_filter(excitation, adpcm, (frame[0] >> 4) & 0x7, dst, count);
+}
+
+__attribute__((target("avx2")))
+static void dsp_frame_decode_avx2(const unsigned char *frame, struct dsp_adpcm *adpcm, const struct audio_output *dst, int count) {
+  signed int excitation[16];
+  const __m256i bytes = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i*)frame));
+  const __m256i index = _mm256_setr_epi8(-1, 1, -1, 1, -1, 2, -1, 2, -1, 3, -1, 3, -1, 4, -1, 4,
+                                         -1, 5, -1, 5, -1, 6, -1, 6, -1, 7, -1, 7, -1, -1, -1, -1);
+  const __m256i select = _mm256_setr_epi16(1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16);
+  const __m256i n = _mm256_srai_epi16(_mm256_mullo_epi16(_mm256_shuffle_epi8(bytes, index), select), 12);
+  const __m128i shift = _mm_cvtsi32_si128((frame[0] & 0xF) + 11);
+  const __m256i bias = _mm256_set1_epi32(1024);
+  __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(n));
+  __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(n, 1));
+  _mm256_storeu_si256((__m256i*)(excitation + 0), _mm256_add_epi32(_mm256_sll_epi32(lo, shift), bias));
+  _mm256_storeu_si256((__m256i*)(excitation + 8), _mm256_add_epi32(_mm256_sll_epi32(hi, shift), bias));
+  
+  dsp_frame_filter(excitation, adpcm, (frame[0] >> 4) & 0x7, dst, count);
+}
+#endif
+
+/** Select the fastest frame decoder supported by the cpu. */
+static dsp_frame_decoder dsp_frame_decoder_select(void) {
+  static dsp_frame_decoder decoder = NULL;
+  if (!decoder) {
+    decoder = dsp_frame_decode_scalar;
+#if HX_X86
+    const unsigned int features = hx_cpu_features();
+    if (features & HX_CPU_SSE2) decoder = dsp_frame_decode_sse2;
+    if (features & HX_CPU_SSSE3) decoder = dsp_frame_decode_ssse3;
+    if (features & HX_CPU_AVX2) decoder = dsp_frame_decode_avx2;
+#endif
+  }
+  return decoder;
+}
+
+static int dsp_decoder_frame(HX_AudioDecoder *d, const struct audio_output *dst, unsigned int count) {
+  const dsp_frame_decoder decode_frame = dsp_frame_decoder_select();
+  for (int c = 0; c < d->info.num_channels; c++) {
+    const unsigned char *src = audio_decoder_frame_data(d, c);
+    const struct audio_output out = audio_output_channel(dst, c);
+    if (src + DSP_BYTES_PER_FRAME <= d->end) {
+      decode_frame(src, d->channels.dsp + c, &out, count);
+    } else {
+      /* the last frame may be truncated */
+      unsigned char frame[DSP_BYTES_PER_FRAME] = { 0 };
+      if (src < d->end) memcpy(frame, src, d->end - src);
+      decode_frame(frame, d->channels.dsp + c, &out, count);
+    }
+  }
+  return 0;
+}
+
+static int dsp_decoder_init(HX_AudioDecoder *d, const HX_AudioStream *in) {
   stream_t stream = stream_create(in->data, in->size, STREAM_MODE_READ, in->info.endianness);
+  if (in->size < d->info.num_channels * DSP_HEADER_SIZE) return -1;
   
-  unsigned int total_samples = 0;
-  struct dsp_adpcm channels[in->info.num_channels];
-  for (int c = 0; c < in->info.num_channels; c++) {
-    struct dsp_adpcm* channel = &channels[c];
+  for (int c = 0; c < d->info.num_channels; c++) {
+    struct dsp_adpcm* channel = &d->channels.dsp[c];
     dsp_adpcm_header_rw(&stream, channel);
-    total_samples += channels[c].num_samples;
-    channels[c].remaining = channels[c].num_samples;
+    channel->history1 = channel->hst1;
+    channel->history2 = channel->hst2;
+    channel->remaining = channel->num_samples;
   }
   
-  audio_stream_info_copy(&out->info, &in->info);
-  out->info.fmt = HX_AUDIO_FORMAT_PCM;
-  out->info.num_samples = total_samples;
-  out->size = dsp_pcm_size(total_samples);
-  out->data = malloc(out->size);
-  
-  short* dst = out->data;
-  char* src = stream.buf + stream.pos;
-  int num_frames = ((total_samples + DSP_SAMPLES_PER_FRAME - 1) / DSP_SAMPLES_PER_FRAME);
-  
-  for (int i = 0; i < num_frames; i++) {
-    for (int c = 0; c < out->info.num_channels; c++) {
-      struct dsp_adpcm *adpcm = channels + c;
-      const signed char ps = *src++;
-      const signed int predictor = (ps >> 4) & 0xF;
-      const signed int scale = 1 << (ps & 0xF);
-      const signed short c1 = adpcm->c[predictor * 2 + 0];
-      const signed short c2 = adpcm->c[predictor * 2 + 1];
-      
-      signed int hst1 = adpcm->history1;
-      signed int hst2 = adpcm->history2;
-      signed int count = (adpcm->remaining > DSP_SAMPLES_PER_FRAME) ? DSP_SAMPLES_PER_FRAME : adpcm->remaining;
-      
-      for (int s = 0; s < count; s++) {
-        int sample = (s % 2) == 0 ? ((*src >> 4) & 0xF) : (*src++ & 0xF);
-        sample = sample >= 8 ? sample - 16 : sample;
-        sample = (((scale * sample) << 11) + 1024 + (c1*hst1 + c2*hst2)) >> 11;
-        if (sample < SHRT_MIN) sample = SHRT_MIN;
-        if (sample > SHRT_MAX) sample = SHRT_MAX;
-        hst2 = hst1;
-        dst[s * out->info.num_channels + c] = hst1 = sample;
+  /* sample count is per channel */
+  d->info.num_samples = d->info.num_channels ? d->channels.dsp[0].num_samples : 0;
+  d->samples_per_frame = DSP_SAMPLES_PER_FRAME;
+  d->bytes_per_frame = DSP_BYTES_PER_FRAME;
+  d->src = (const unsigned char*)stream.buf + stream.pos;
+  d->decode = dsp_decoder_frame;
+  return 0;
+}
+
+/* Coefficient analysis, after the reference DSPADPCM encoder. */
+typedef double dsp_vec3[3];
+
+static void dsp_inner_product_merge(dsp_vec3 out, const signed short *pcm) {
+  for (int i = 0; i <= 2; i++) {
+    out[i] = 0.0;
+    /* negative indices reach into the previous frame */
+    for (int x = 0; x < DSP_SAMPLES_PER_FRAME; x++) out[i] -= pcm[x - i] * pcm[x];
+  }
+}
+
+static void dsp_outer_product_merge(dsp_vec3 mtx[3], const signed short *pcm) {
+  for (int x = 1; x <= 2; x++) {
+    for (int y = 1; y <= 2; y++) {
+      mtx[x][y] = 0.0;
+      for (int z = 0; z < DSP_SAMPLES_PER_FRAME; z++) mtx[x][y] += pcm[z - x] * pcm[z - y];
+    }
+  }
+}
+
+/** LU decomposition with partial pivoting. Returns nonzero if the matrix is singular. */
+static int dsp_analyze_ranges(dsp_vec3 mtx[3], int *indices) {
+  double recips[3], val, tmp, lo, hi;
+  int pivot = 0;
+  
+  for (int x = 1; x <= 2; x++) {
+    val = max(fabs(mtx[x][1]), fabs(mtx[x][2]));
+    if (val < DBL_EPSILON) return 1;
+    recips[x] = 1.0 / val;
+  }
+  
+  for (int i = 1; i <= 2; i++) {
+    for (int x = 1; x < i; x++) {
+      tmp = mtx[x][i];
+      for (int y = 1; y < x; y++) tmp -= mtx[x][y] * mtx[y][i];
+      mtx[x][i] = tmp;
+    }
+    
+    val = 0.0;
+    for (int x = i; x <= 2; x++) {
+      tmp = mtx[x][i];
+      for (int y = 1; y < i; y++) tmp -= mtx[x][y] * mtx[y][i];
+      mtx[x][i] = tmp;
+      tmp = fabs(tmp) * recips[x];
+      if (tmp >= val) {
+        val = tmp;
+        pivot = x;
       }
-          
-      adpcm->history1 = hst1;
-      adpcm->history2 = hst2;
-      adpcm->remaining -= count;
     }
     
-    dst += DSP_SAMPLES_PER_FRAME * out->info.num_channels;
+    if (pivot != i) {
+      for (int y = 1; y <= 2; y++) {
+        tmp = mtx[pivot][y];
+        mtx[pivot][y] = mtx[i][y];
+        mtx[i][y] = tmp;
+      }
+      recips[pivot] = recips[i];
+    }
+    
+    indices[i] = pivot;
+    if (mtx[i][i] == 0.0) return 1;
+    
+    if (i != 2) {
+      tmp = 1.0 / mtx[i][i];
+      for (int x = i + 1; x <= 2; x++) mtx[x][i] *= tmp;
+    }
   }
   
-  return 0;
+  lo = 1.0e10;
+  hi = 0.0;
+  for (int i = 1; i <= 2; i++) {
+    tmp = fabs(mtx[i][i]);
+    if (tmp < lo) lo = tmp;
+    if (tmp > hi) hi = tmp;
+  }
+  
+  return lo / hi < 1.0e-10;
+}
+
+static void dsp_bidirectional_filter(dsp_vec3 mtx[3], const int *indices, dsp_vec3 vec) {
+  double tmp;
+  for (int i = 1, x = 0; i <= 2; i++) {
+    int index = indices[i];
+    tmp = vec[index];
+    vec[index] = vec[i];
+    if (x != 0) {
+      for (int y = x; y <= i - 1; y++) tmp -= vec[y] * mtx[i][y];
+    } else if (tmp != 0.0) {
+      x = i;
+    }
+    vec[i] = tmp;
+  }
+  
+  for (int i = 2; i > 0; i--) {
+    tmp = vec[i];
+    for (int y = i + 1; y <= 2; y++) tmp -= vec[y] * mtx[i][y];
+    vec[i] = tmp / mtx[i][i];
+  }
+  
+  vec[0] = 1.0;
+}
+
+/** Returns nonzero if the filter is unstable. */
+static int dsp_quadratic_merge(dsp_vec3 vec) {
+  double v2 = vec[2], tmp = 1.0 - (v2 * v2);
+  if (tmp == 0.0) return 1;
+  
+  double v0 = (vec[0] - (v2 * v2)) / tmp;
+  double v1 = (vec[1] - (vec[1] * v2)) / tmp;
+  vec[0] = v0;
+  vec[1] = v1;
+  return fabs(v1) > 1.0;
+}
+
+static void dsp_finish_record(dsp_vec3 in, dsp_vec3 out) {
+  for (int z = 1; z <= 2; z++) {
+    if (in[z] >= 1.0) in[z] = 0.9999999999;
+    else if (in[z] <= -1.0) in[z] = -0.9999999999;
+  }
+  out[0] = 1.0;
+  out[1] = (in[2] * in[1]) + in[1];
+  out[2] = in[2];
+}
+
+static void dsp_matrix_filter(const dsp_vec3 src, dsp_vec3 dst) {
+  dsp_vec3 mtx[3];
+  
+  mtx[2][0] = 1.0;
+  for (int i = 1; i <= 2; i++) mtx[2][i] = -src[i];
+  
+  for (int i = 2; i > 0; i--) {
+    double val = 1.0 - (mtx[i][i] * mtx[i][i]);
+    for (int y = 1; y <= i; y++) mtx[i - 1][y] = ((mtx[i][i] * mtx[i][y]) + mtx[i][y]) / val;
+  }
+  
+  dst[0] = 1.0;
+  for (int i = 1; i <= 2; i++) {
+    dst[i] = 0.0;
+    for (int y = 1; y <= i; y++) dst[i] += mtx[i][y] * dst[i - y];
+  }
+}
+
+static void dsp_merge_finish_record(const dsp_vec3 src, dsp_vec3 dst) {
+  dsp_vec3 tmp;
+  double val = src[0];
+  
+  dst[0] = 1.0;
+  for (int i = 1; i <= 2; i++) {
+    double v2 = 0.0;
+    for (int y = 1; y < i; y++) v2 += dst[y] * src[i - y];
+    dst[i] = (val > 0.0) ? -(v2 + src[i]) / val : 0.0;
+    tmp[i] = dst[i];
+    for (int y = 1; y < i; y++) dst[y] += dst[i] * dst[i - y];
+    val *= 1.0 - (dst[i] * dst[i]);
+  }
+  
+  dsp_finish_record(tmp, dst);
+}
+
+static double dsp_contrast_vectors(const dsp_vec3 a, const dsp_vec3 b) {
+  double val = (b[2] * b[1] + -b[1]) / (1.0 - b[2] * b[2]);
+  double val1 = (a[0] * a[0]) + (a[1] * a[1]) + (a[2] * a[2]);
+  double val2 = (a[0] * a[1]) + (a[1] * a[2]);
+  double val3 = a[0] * a[2];
+  return val1 + (2.0 * val * val2) + (2.0 * (-b[1] * val + -b[2]) * val3);
+}
+
+/** Cluster the per-frame records around the current best predictors. */
+static void dsp_filter_records(dsp_vec3 best[8], int count, const dsp_vec3 *records, unsigned int num_records) {
+  dsp_vec3 sums[8], filtered;
+  int hits[8];
+  
+  for (int pass = 0; pass < 2; pass++) {
+    for (int y = 0; y < count; y++) {
+      hits[y] = 0;
+      sums[y][0] = sums[y][1] = sums[y][2] = 0.0;
+    }
+    
+    for (unsigned int z = 0; z < num_records; z++) {
+      int index = 0;
+      double value = 1.0e30;
+      for (int i = 0; i < count; i++) {
+        double contrast = dsp_contrast_vectors(best[i], records[z]);
+        if (contrast < value) {
+          value = contrast;
+          index = i;
+        }
+      }
+      hits[index]++;
+      dsp_matrix_filter(records[z], filtered);
+      for (int i = 0; i <= 2; i++) sums[index][i] += filtered[i];
+    }
+    
+    for (int i = 0; i < count; i++)
+      if (hits[i] > 0) for (int y = 0; y <= 2; y++) sums[i][y] /= hits[i];
+    
+    for (int i = 0; i < count; i++) dsp_merge_finish_record(sums[i], best[i]);
+  }
+}
+
+static signed short dsp_coefficient_quantize(double d) {
+  d *= 2048.0;
+  if (d > 0.0) return (d > 32767.0) ? SHRT_MAX : (signed short)(d + 0.5);
+  return (d < -32768.0) ? SHRT_MIN : (signed short)(d - 0.5);
 }
 
-static void dsp_frame_encode(signed short pcm[16], unsigned int num_samples, signed char adpcm[DSP_BYTES_PER_FRAME]) {
-  int inSamples[16] = { pcm[0], pcm[1] };
-  int outSamples[14], scale, v1, v2, v3, index, distance;
-  double acc = 0.0f;
+/**
+ * Derive the eight predictor coefficient pairs for a single channel,
+ * `stride` samples apart, from the autocorrelation of each frame.
+ * `records` must hold one record per frame.
+ */
+static void dsp_correlate_coefficients(const signed short *src, unsigned int stride, unsigned int num_samples, dsp_vec3 *records, signed short coefs[8][2]) {
+  const unsigned int num_frames = (num_samples + DSP_SAMPLES_PER_FRAME - 1) / DSP_SAMPLES_PER_FRAME;
+  signed short history[2][DSP_SAMPLES_PER_FRAME] = { 0 };
+  dsp_vec3 vec1, vec2, mtx[3], best[8];
+  unsigned int num_records = 0;
+  int indices[3];
+  
+  for (unsigned int n = 0; n < num_frames; n++) {
+    const unsigned int count = min(num_samples - n * DSP_SAMPLES_PER_FRAME, DSP_SAMPLES_PER_FRAME);
+    memcpy(history[0], history[1], sizeof(history[1]));
+    memset(history[1], 0, sizeof(history[1]));
+    for (unsigned int s = 0; s < count; s++) history[1][s] = src[(n * DSP_SAMPLES_PER_FRAME + s) * stride];
+    
+    dsp_inner_product_merge(vec1, history[1]);
+    if (fabs(vec1[0]) > 10.0) {
+      dsp_outer_product_merge(mtx, history[1]);
+      if (!dsp_analyze_ranges(mtx, indices)) {
+        dsp_bidirectional_filter(mtx, indices, vec1);
+        if (!dsp_quadratic_merge(vec1)) dsp_finish_record(vec1, records[num_records++]);
+      }
+    }
+  }
+  
+  vec1[0] = 1.0;
+  vec1[1] = vec1[2] = 0.0;
+  for (unsigned int z = 0; z < num_records; z++) {
+    dsp_matrix_filter(records[z], best[0]);
+    for (int y = 1; y <= 2; y++) vec1[y] += best[0][y];
+  }
+  if (num_records) for (int y = 1; y <= 2; y++) vec1[y] /= num_records;
+  dsp_merge_finish_record(vec1, best[0]);
+  
+  /* split every predictor in two until there are eight */
+  for (int count = 1; count < 8; count *= 2) {
+    vec2[0] = 0.0;
+    vec2[1] = -1.0;
+    vec2[2] = 0.0;
+    for (int i = 0; i < count; i++)
+      for (int y = 0; y <= 2; y++) best[count + i][y] = (0.01 * vec2[y]) + best[i][y];
+    dsp_filter_records(best, count * 2, records, num_records);
+  }
   
+  for (int z = 0; z < 8; z++) {
+    coefs[z][0] = dsp_coefficient_quantize(-best[z][1]);
+    coefs[z][1] = dsp_coefficient_quantize(-best[z][2]);
+  }
+}
+
+/** Result of encoding one frame with each of the eight predictors. */
+struct dsp_encode_trial {
+  signed int scale[8];
+  unsigned long long error[8];
+  signed int nibbles[8][DSP_SAMPLES_PER_FRAME];
+  signed int decoded[8][DSP_SAMPLES_PER_FRAME];
+};
+
+/**
+ * Encode a frame with all eight predictors. pcm[0] and pcm[1] hold the
+ * last two decoded samples of the previous frame, followed by the input.
+ */
+typedef void dsp_encode_evaluator(const signed short pcm[16], int num_samples, const signed short coefs[8][2], struct dsp_encode_trial *trial);
+
+static int dsp_encode_initial_scale(const signed short pcm[16], int num_samples, const signed short coef[2]) {
+  int distance = 0, scale;
   for (int s = 0; s < num_samples; s++) {
-    inSamples[s + 2] = v1 = ((pcm[s] * 0.0f) + (pcm[s + 1] * 0.0f)) / 2048;
-    v2 = pcm[s + 2] - v1;
-    v3 = (v2 >= SHRT_MAX) ? SHRT_MAX : (v2 <= SHRT_MIN) ? SHRT_MIN : v2;
+    int v1 = ((pcm[s] * coef[1]) + (pcm[s + 1] * coef[0])) / 2048;
+    int v2 = pcm[s + 2] - v1;
+    int v3 = (v2 >= SHRT_MAX) ? SHRT_MAX : (v2 <= SHRT_MIN) ? SHRT_MIN : v2;
     if (abs(v3) > abs(distance)) distance = v3;
   }
-  
   for (scale = 0; (scale <= 12) && ((distance > 7) || (distance < -8)); scale++) distance /= 2;
-  scale = (scale <= 1) ? -1 : scale - 2;
+  return (scale <= 1) ? -1 : scale - 2;
+}
+
+/** Next scale to try, or -1 if the current one is final. */
+static int dsp_encode_next_scale(int scale, int index) {
+  for (int x = index + 8; x > 256; x >>= 1) if (++scale >= 12) scale = 11;
+  return (scale < 12 && index > 1) ? scale : -1;
+}
+
+/** Divide by 2^(scale+11), rounding halves away from zero. */
+static inline int dsp_encode_round(int v, int scale) {
+  const int shift = scale + 11, half = 1 << (shift - 1);
+  return (v > 0) ? (v + half) >> shift : -((-v + half) >> shift);
+}
+
+static void dsp_encode_evaluate_scalar(const signed short pcm[16], int num_samples, const signed short coefs[8][2], struct dsp_encode_trial *trial) {
+  for (int i = 0; i < 8; i++) {
+    for (int scale = dsp_encode_initial_scale(pcm, num_samples, coefs[i]) + 1; scale >= 0;) {
+      int in[16] = { pcm[0], pcm[1] }, index = 0;
+      unsigned long long error = 0;
+      
+      for (int s = 0; s < num_samples; s++) {
+        int v1 = (in[s] * coefs[i][1]) + (in[s + 1] * coefs[i][0]);
+        int v3 = dsp_encode_round((pcm[s + 2] << 11) - v1, scale);
+        if (v3 < -8) {
+          index = max(index, -8 - v3);
+          v3 = -8;
+        } else if (v3 > 7) {
+          index = max(index, v3 - 7);
+          v3 = 7;
+        }
+        
+        trial->nibbles[i][s] = v3;
+        v1 = (v1 + ((v3 * (1 << scale)) << 11) + 1024) >> 11;
+        in[s + 2] = (v1 >= SHRT_MAX) ? SHRT_MAX : (v1 <= SHRT_MIN) ? SHRT_MIN : v1;
+        trial->decoded[i][s] = in[s + 2];
+        const long long d = pcm[s + 2] - in[s + 2];
+        error += d * d;
+      }
+      
+      trial->scale[i] = scale;
+      trial->error[i] = error;
+      const int next = dsp_encode_next_scale(scale, index);
+      scale = (next < 0) ? -1 : next + 1;
+    }
+  }
+}
 
-  do {
-    scale++;
-    acc = index = 0;
+#if HX_X86
+/* All eight predictors are evaluated at once, one per lane. Lanes that
+ * settle on a scale early keep their result while the others retry. */
+__attribute__((target("avx2")))
+static void dsp_encode_evaluate_avx2(const signed short pcm[16], int num_samples, const signed short coefs[8][2], struct dsp_encode_trial *trial) {
+  const __m256i nibble_min = _mm256_set1_epi32(-8), nibble_max = _mm256_set1_epi32(7);
+  const __m256i sample_min = _mm256_set1_epi32(SHRT_MIN), sample_max = _mm256_set1_epi32(SHRT_MAX);
+  const __m256i one = _mm256_set1_epi32(1), bias = _mm256_set1_epi32(1024);
+  signed int c1[8], c2[8], scale[8], active = 0;
+  
+  for (int i = 0; i < 8; i++) {
+    c1[i] = coefs[i][0];
+    c2[i] = coefs[i][1];
+    scale[i] = dsp_encode_initial_scale(pcm, num_samples, coefs[i]) + 1;
+    active |= 1 << i;
+  }
+  
+  const __m256i coef1 = _mm256_loadu_si256((const __m256i*)c1);
+  const __m256i coef2 = _mm256_loadu_si256((const __m256i*)c2);
+  
+  while (active) {
+    signed int nibbles[DSP_SAMPLES_PER_FRAME][8], decoded[DSP_SAMPLES_PER_FRAME][8], index[8];
+    unsigned long long error[8];
+    
+    const __m256i shift = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)scale), _mm256_set1_epi32(11));
+    const __m256i half = _mm256_sllv_epi32(one, _mm256_sub_epi32(shift, one));
+    __m256i hst2 = _mm256_set1_epi32(pcm[0]), hst1 = _mm256_set1_epi32(pcm[1]);
+    __m256i idx = _mm256_setzero_si256(), even = _mm256_setzero_si256(), odd = _mm256_setzero_si256();
+    
     for (int s = 0; s < num_samples; s++) {
-      v1 = ((inSamples[s] * 0.0f) + (inSamples[s + 1] * 0.0f));
-      v2 = (pcm[s + 2] << 11) - v1;
-      v3 = (v2 > 0) ? (int)((double)v2 / (1 << scale) / 2048 + 0.5f) : (int)((double)v2 / (1 << scale) / 2048 - 0.5f);
+      const __m256i xs = _mm256_set1_epi32(pcm[s + 2]);
+      const __m256i v1 = _mm256_add_epi32(_mm256_mullo_epi32(hst2, coef2), _mm256_mullo_epi32(hst1, coef1));
+      const __m256i v2 = _mm256_sub_epi32(_mm256_slli_epi32(xs, 11), v1);
+      __m256i v3 = _mm256_sign_epi32(_mm256_srav_epi32(_mm256_add_epi32(_mm256_abs_epi32(v2), half), shift), v2);
+      idx = _mm256_max_epi32(idx, _mm256_max_epi32(_mm256_sub_epi32(v3, nibble_max), _mm256_sub_epi32(nibble_min, v3)));
+      v3 = _mm256_max_epi32(nibble_min, _mm256_min_epi32(nibble_max, v3));
+      _mm256_storeu_si256((__m256i*)nibbles[s], v3);
       
-      if (v3<-8) {
-        if (index < (v3=-8-v3)) index = v3; v3 = -8;
-      } else if (v3 > 7) {
-        if (index < (v3-=7)) index = v3; v3 = 7;
+      __m256i y = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(v1, _mm256_sllv_epi32(v3, shift)), bias), 11);
+      y = _mm256_max_epi32(sample_min, _mm256_min_epi32(sample_max, y));
+      _mm256_storeu_si256((__m256i*)decoded[s], y);
+      
+      const __m256i d = _mm256_sub_epi32(xs, y);
+      const __m256i dh = _mm256_srli_epi64(d, 32);
+      even = _mm256_add_epi64(even, _mm256_mul_epi32(d, d));
+      odd = _mm256_add_epi64(odd, _mm256_mul_epi32(dh, dh));
+      hst2 = hst1;
+      hst1 = y;
+    }
+    
+    unsigned long long e[4], o[4];
+    _mm256_storeu_si256((__m256i*)index, idx);
+    _mm256_storeu_si256((__m256i*)e, even);
+    _mm256_storeu_si256((__m256i*)o, odd);
+    for (int i = 0; i < 4; i++) {
+      error[2 * i + 0] = e[i];
+      error[2 * i + 1] = o[i];
+    }
+    
+    for (int i = 0; i < 8; i++) {
+      if (!(active & (1 << i))) continue;
+      for (int s = 0; s < num_samples; s++) {
+        trial->nibbles[i][s] = nibbles[s][i];
+        trial->decoded[i][s] = decoded[s][i];
       }
+      trial->scale[i] = scale[i];
+      trial->error[i] = error[i];
       
-      outSamples[s] = v3;
-      v1 = (v1 + ((v3 * (1 << scale)) << 11) + 1024) >> 11;
-      inSamples[s+2] = v2 = (v1 >= SHRT_MAX) ? SHRT_MAX : (v1 <= SHRT_MIN) ? SHRT_MIN : v1;
-      v3 = pcm[s+2] - v2;
-      acc += v3 * (double)v3;
+      const int next = dsp_encode_next_scale(scale[i], index[i]);
+      if (next < 0) active &= ~(1 << i);
+      else scale[i] = next + 1;
     }
-    for (int x = index + 8; x > 256; x >>= 1) if (++scale >= 12) scale = 11;
-  } while (scale < 12 && index > 1);
+  }
+}
+#endif
+
+/** Select the fastest frame evaluator supported by the cpu. */
+static dsp_encode_evaluator* dsp_encode_evaluator_select(void) {
+  static dsp_encode_evaluator* evaluator = NULL;
+  if (!evaluator) {
+    evaluator = dsp_encode_evaluate_scalar;
+#if HX_X86
+    if (hx_cpu_features() & HX_CPU_AVX2) evaluator = dsp_encode_evaluate_avx2;
+#endif
+  }
+  return evaluator;
+}
+
+/**
+ * Encode up to 14 samples at pcm + 2 using the predictor with the
+ * smallest error, then replace them with their decoded values so
+ * that pcm[14] and pcm[15] become the history of the next frame.
+ */
+static void dsp_frame_encode(signed short pcm[16], unsigned int num_samples, const signed short coefs[8][2], unsigned char adpcm[DSP_BYTES_PER_FRAME]) {
+  struct dsp_encode_trial trial;
+  int nibbles[DSP_SAMPLES_PER_FRAME] = { 0 }, best = 0;
+  
+  dsp_encode_evaluator_select()(pcm, num_samples, coefs, &trial);
+  for (int i = 1; i < 8; i++) if (trial.error[i] < trial.error[best]) best = i;
   
-  adpcm[0] = scale & 0xF;
-  for (int s = num_samples; s < 14; s++) outSamples[s] = 0;
-  for (int y = 0; y < 7; y++) adpcm[y+1] = (char)((outSamples[y*2]<<4) | (outSamples[y*2+1]&0xF));
+  for (int s = 0; s < num_samples; s++) {
+    pcm[s + 2] = trial.decoded[best][s];
+    nibbles[s] = trial.nibbles[best][s];
+  }
+  
+  adpcm[0] = (best << 4) | (trial.scale[best] & 0xF);
+  for (int y = 0; y < 7; y++) adpcm[y + 1] = (nibbles[y * 2] << 4) | (nibbles[y * 2 + 1] & 0xF);
+}
+
+static HX_Size dsp_encoded_size(const HX_AudioStream *in) {
+  const unsigned int framecount = (in->info.num_samples + DSP_SAMPLES_PER_FRAME - 1) / DSP_SAMPLES_PER_FRAME;
+  return in->info.num_channels * (DSP_HEADER_SIZE + framecount * DSP_BYTES_PER_FRAME);
+}
+
+/** Records of the coefficient analysis of one channel, plus room to align them */
+static HX_Size dsp_encode_scratch_size(const HX_AudioStream *in) {
+  const unsigned int framecount = (in->info.num_samples + DSP_SAMPLES_PER_FRAME - 1) / DSP_SAMPLES_PER_FRAME;
+  return framecount * sizeof(dsp_vec3) + sizeof(double) - 1;
 }
 
-static int dsp_encode(const HX_AudioStream *in, HX_AudioStream *out) {
-  unsigned int num_samples = in->info.num_samples;
-  unsigned int framecount = (num_samples / DSP_SAMPLES_PER_FRAME) + (num_samples % DSP_SAMPLES_PER_FRAME != 0);
-  unsigned int output_stream_size = framecount * DSP_BYTES_PER_FRAME * in->info.num_channels + in->info.num_channels * DSP_HEADER_SIZE;
-  output_stream_size *= 2;
+/*
+ * The predictor search is already exhaustive, so the mode is ignored.
+ * The coefficient analysis records are kept in `buf` past the output.
+ */
+static int dsp_encode_into(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode, void *buf, HX_Size cap) {
+  const unsigned int num_channels = in->info.num_channels;
+  const unsigned int num_samples = in->info.num_samples;
+  const unsigned int framecount = (num_samples + DSP_SAMPLES_PER_FRAME - 1) / DSP_SAMPLES_PER_FRAME;
+  const unsigned int output_stream_size = dsp_encoded_size(in);
+  if (!num_channels) return -1;
+  if (cap < output_stream_size + dsp_encode_scratch_size(in)) return HX_AUDIO_BUFFER_TOO_SMALL;
+  
+  const uintptr_t records_address = (uintptr_t)buf + output_stream_size;
+  dsp_vec3 *records = (dsp_vec3*)((records_address + sizeof(double) - 1) & ~(uintptr_t)(sizeof(double) - 1));
+  
+  struct dsp_adpcm header[num_channels];
+  signed short coefs[num_channels][8][2];
+  signed short history[num_channels][16];
+  memset(header, 0, sizeof(header));
+  memset(history, 0, sizeof(history));
+  
+  /* analyze each channel separately */
+  for (unsigned int channel = 0; channel < num_channels; channel++)
+    dsp_correlate_coefficients(in->data + channel, num_channels, num_samples, records, coefs[channel]);
   
   audio_stream_info_copy(&out->info, &in->info);
   out->info.fmt = HX_AUDIO_FORMAT_DSP;
   out->info.endianness = HX_BIG_ENDIAN;
   
-  stream_t output_stream = stream_alloc(output_stream_size, STREAM_MODE_WRITE, out->info.endianness);
-  out->data = (signed short*)output_stream.buf;
+  /* clear the header padding */
+  memset(buf, 0, num_channels * DSP_HEADER_SIZE);
+  stream_t output_stream = stream_create(buf, output_stream_size, STREAM_MODE_WRITE, out->info.endianness);
+  out->data = buf;
   out->size = output_stream_size;
   
-  stream_seek(&output_stream, out->info.num_channels * DSP_HEADER_SIZE);
-
-  signed short samples[16];
-  signed short* src = in->data;
-  struct dsp_adpcm header[out->info.num_channels];
+  stream_seek(&output_stream, num_channels * DSP_HEADER_SIZE);
   
   for (unsigned int n = 0; n < framecount; n++) {
-    for (unsigned int channel = 0; channel < out->info.num_channels; channel++) {
-      
-      unsigned int samples_to_process = min(num_samples - n * DSP_SAMPLES_PER_FRAME, DSP_SAMPLES_PER_FRAME);
+    const unsigned int samples_to_process = min(num_samples - n * DSP_SAMPLES_PER_FRAME, DSP_SAMPLES_PER_FRAME);
+    const signed short *src = in->data + n * DSP_SAMPLES_PER_FRAME * num_channels;
+    
+    for (unsigned int channel = 0; channel < num_channels; channel++) {
+      signed short *samples = history[channel];
       memset(samples + 2, 0, DSP_SAMPLES_PER_FRAME * sizeof(short));
+      for (unsigned int s = 0; s < samples_to_process; s++)
+        samples[s + 2] = src[s * num_channels + channel];
       
-      for (int s = 0; s < samples_to_process; ++s)
-        samples[s + 2] = src[n * DSP_SAMPLES_PER_FRAME * out->info.num_channels + (channel + s * out->info.num_channels)];
-      
-      signed char frame[8];
-      dsp_frame_encode(samples, DSP_SAMPLES_PER_FRAME, frame);
+      unsigned char frame[DSP_BYTES_PER_FRAME];
+      dsp_frame_encode(samples, samples_to_process, (const signed short (*)[2])coefs[channel], frame);
+      samples[0] = samples[14];
+      samples[1] = samples[15];
       
       if (n == 0) {
-        header[channel].num_samples = out->info.num_samples;
+        header[channel].num_samples = num_samples;
         header[channel].num_nibbles = dsp_nibble_count(num_samples);
         header[channel].sample_rate = out->info.sample_rate;
         header[channel].loop_start = dsp_nibble_address(0);
-        header[channel].loop_end = dsp_nibble_address(num_samples - 1);
+        header[channel].loop_end = dsp_nibble_address(num_samples ? num_samples - 1 : 0);
         header[channel].ca = dsp_nibble_address(0);
         header[channel].ps = frame[0];
-        memset(header[channel].c, 0, 16 * sizeof(short));
+        for (int i = 0; i < 8; i++) {
+          header[channel].c[i * 2 + 0] = coefs[channel][i][0];
+          header[channel].c[i * 2 + 1] = coefs[channel][i][1];
+        }
       }
-      stream_rw(&output_stream, frame, dsp_byte_count(samples_to_process));
+      /* always write whole frames to keep the channels interleaved */
+      stream_rw(&output_stream, frame, DSP_BYTES_PER_FRAME);
     }
   }
   
@@ -228,12 +905,20 @@ static int dsp_encode(const HX_AudioStream *in, HX_AudioStream *out) {
   
   /* Write headers */
   stream_seek(&output_stream, 0);
-  for (int i = 0; i < out->info.num_channels; i++)
+  for (unsigned int i = 0; i < num_channels; i++)
     dsp_adpcm_header_rw(&output_stream, header + i);
   
   return 0;
 }
 
+static int dsp_encode(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode) {
+  if (audio_encode_alloc(in, out, mode, dsp_encoded_size(in) + dsp_encode_scratch_size(in), dsp_encode_into) != 0) return -1;
+  /* drop the analysis records past the output */
+  void *data = realloc(out->data, out->size);
+  if (data) out->data = data;
+  return 0;
+}
+
 
 #pragma mark - PSX ADPCM
 
@@ -241,23 +926,18 @@ static int dsp_encode(const HX_AudioStream *in, HX_AudioStream *out) {
 #define PSX_SAMPLE_BYTES_PER_FRAME 14
 #define PSX_SAMPLES_PER_FRAME 28
 
-static const float psx_adpcm_coefficients[16][2] = {
-  { 0.0       ,  0.0       },
-  { 0.9375    ,  0.0       },
-  { 1.796875  , -0.8125    },
-  { 1.53125   , -0.859375  },
-  { 1.90625   , -0.9375    },
-  { 0.46875   , -0.0       },
-  { 0.8984375 , -0.40625   },
-  { 0.765625  , -0.4296875 },
-  { 0.953125  , -0.46875   },
-  { 0.234375  , -0.0       },
-  { 0.44921875, -0.203125  },
-  { 0.3828125 , -0.21484375},
-  { 0.4765625 , -0.234375  },
-  { 0.5       , -0.9375    },
-  { 0.234375  , -0.9375    },
-  { 0.109375  , -0.9375    },
+/* Loop flags in the second byte of a frame */
+#define PSX_FLAG_LOOP_END     (1 << 0)
+#define PSX_FLAG_LOOP_REPEAT  (1 << 1)
+#define PSX_FLAG_LOOP_START   (1 << 2)
+
+/** Filter coefficients in 1/64 fixed-point, as used by the SPU */
+static const signed int psx_adpcm_coefficients[5][2] = {
+  {   0,   0 },
+  {  60,   0 },
+  { 115, -52 },
+  {  98, -55 },
+  { 122, -60 },
 };
 
 static const HX_Size psx_sample_count(const HX_Size sz, const int ch) {
@@ -271,54 +951,1731 @@ static const HX_Size psx_pcm_size(const HX_Size sample_count) {
   return frames * PSX_SAMPLES_PER_FRAME * sizeof(short);
 }
 
-static int psx_decode(const HX_AudioStream *in, HX_AudioStream *out) {
-  stream_t stream = stream_create(in->data, in->size, STREAM_MODE_READ, in->info.endianness);
-  const HX_Size total_samples = psx_sample_count(in->size, in->info.num_channels);
+struct psx_adpcm {
+  signed int history1, history2;
+};
+
+/**
+ * Decode a single 16-byte frame of one channel into the channel output `dst`.
+ * Returns -1 if the frame uses an invalid filter.
+ */
+typedef int (*psx_frame_decoder)(const unsigned char *frame, struct psx_adpcm *adpcm, const struct audio_output *dst);
+
+/**
+ * Run the filter over a frame of shifted residuals premultiplied by 64.
+ * The output is truncated toward zero, matching the original floating point decoder.
+ */
+static inline void psx_frame_filter(const signed int *excitation, struct psx_adpcm *adpcm, unsigned char predict, const struct audio_output *dst) {
+  const signed int c1 = psx_adpcm_coefficients[predict][0];
+  const signed int c2 = psx_adpcm_coefficients[predict][1];
+  signed int hst1 = adpcm->history1;
+  signed int hst2 = adpcm->history2;
+  
+  for (int s = 0; s < PSX_SAMPLES_PER_FRAME; s++) {
+    signed int sample = (excitation[s] + c1*hst1 + c2*hst2) / 64;
+    sample = sample < SHRT_MIN ? SHRT_MIN : sample;
+    sample = sample > SHRT_MAX ? SHRT_MAX : sample;
+    hst2 = hst1;
+    audio_output_store(dst, s, hst1 = sample);
+  }
   
-  signed int history[in->info.num_channels][2];
-  memset(history, 0, in->info.num_channels * 2);
+  adpcm->history1 = hst1;
+  adpcm->history2 = hst2;
+}
+
+/** Reference decoder */
+static int psx_frame_decode_scalar(const unsigned char *frame, struct psx_adpcm *adpcm, const struct audio_output *dst) {
+  const unsigned char predict = (frame[0] >> 4) & 0xF;
+  const unsigned char shift = (frame[0] >> 0) & 0xF;
+  if (predict > 4) return -1;
   
-  audio_stream_info_copy(&out->info, &in->info);
-  out->info.fmt = HX_AUDIO_FORMAT_PCM;
-  out->info.num_samples = total_samples;
-  out->size = psx_pcm_size(total_samples);
-  out->data = malloc(out->size);
-  
-  short* dst = out->data;
-  char* src = stream.buf + stream.pos;
-  int num_frames = ((total_samples + PSX_SAMPLES_PER_FRAME - 1) / PSX_SAMPLES_PER_FRAME);
-  
-  for (int i = 0; i < num_frames; dst += PSX_SAMPLES_PER_FRAME * out->info.num_channels, i++) {
-    for (int c = 0; c < out->info.num_channels; src += PSX_SAMPLE_BYTES_PER_FRAME, c++) {
-      const unsigned char predict = (*src >> 4) & 0xF;
-      const unsigned char shift = (*src++ >> 0) & 0xF;
-      const unsigned char __unused flags = (*src++);
-      
-      if (predict > 4) return -1;
-      
-      signed int hst1 = history[c][0];
-      signed int hst2 = history[c][1];
-      signed int expanded[PSX_SAMPLES_PER_FRAME];
-      for (signed int y=0; y<PSX_SAMPLE_BYTES_PER_FRAME; y++) {
-        expanded[y*2+0] = (src[y] & 0xF);
-        expanded[y*2+1] = (src[y] & 0xF0) >> 4;
-      }
-      
-      for (signed int s=0; s<PSX_SAMPLES_PER_FRAME; s++) {
-        int sample = expanded[s] << 12;
-        if ((sample & 0x8000) != 0) {
-          sample = (int)(sample | 0xFFFF0000);
-        }
-        
-        double output = (sample >> shift) + hst1 * psx_adpcm_coefficients[predict][0] + hst2 * psx_adpcm_coefficients[predict][1];
-        hst2 = hst1;
-        dst[s * out->info.num_channels + c] = hst1 = ((short)(min(SHRT_MAX, max(output, SHRT_MIN))));
-      }
-      
-      history[c][0] = hst1;
-      history[c][1] = hst2;
-    }
+  signed int excitation[PSX_SAMPLES_PER_FRAME];
+  for (int y = 0; y < PSX_SAMPLE_BYTES_PER_FRAME; y++) {
+    /* nibble in the top bits of a 16-bit word, low nibble first */
+    excitation[y*2+0] = ((signed short)((frame[2 + y] & 0x0F) << 12) >> shift) * 64;
+    excitation[y*2+1] = ((signed short)((frame[2 + y] & 0xF0) << 8) >> shift) * 64;
+  }
+  
+  psx_frame_filter(excitation, adpcm, predict, dst);
+  return 0;
+}
+
+#if HX_X86
+__attribute__((target("sse2")))
+static int psx_frame_decode_sse2(const unsigned char *frame, struct psx_adpcm *adpcm, const struct audio_output *dst) {
+  const unsigned char predict = (frame[0] >> 4) & 0xF;
+  if (predict > 4) return -1;
+  
+  signed int excitation[32];
+  const __m128i mask = _mm_set1_epi8((char)0xF0), zero = _mm_setzero_si128();
+  const __m128i bytes = _mm_srli_si128(_mm_loadu_si128((const __m128i*)frame), 2);
+  /* nibbles in the high half of each byte, low nibble first */
+  const __m128i lo = _mm_and_si128(_mm_slli_epi16(bytes, 4), mask);
+  const __m128i hi = _mm_and_si128(bytes, mask);
+  const __m128i nibbles[2] = { _mm_unpacklo_epi8(lo, hi), _mm_unpackhi_epi8(lo, hi) };
+  const __m128i shift = _mm_cvtsi32_si128(frame[0] & 0xF);
+  for (int i = 0; i < 2; i++) {
+    /* (nibble << 12) >> shift, sign-extended and multiplied by 64 */
+    __m128i n0 = _mm_sra_epi16(_mm_unpacklo_epi8(zero, nibbles[i]), shift);
+    __m128i n1 = _mm_sra_epi16(_mm_unpackhi_epi8(zero, nibbles[i]), shift);
+    _mm_storeu_si128((__m128i*)(excitation + i * 16 +  0), _mm_srai_epi32(_mm_unpacklo_epi16(zero, n0), 10));
+    _mm_storeu_si128((__m128i*)(excitation + i * 16 +  4), _mm_srai_epi32(_mm_unpackhi_epi16(zero, n0), 10));
+    _mm_storeu_si128((__m128i*)(excitation + i * 16 +  8), _mm_srai_epi32(_mm_unpacklo_epi16(zero, n1), 10));
+    _mm_storeu_si128((__m128i*)(excitation + i * 16 + 12), _mm_srai_epi32(_mm_unpackhi_epi16(zero, n1), 10));
   }
   
+  psx_frame_filter(excitation, adpcm, predict, dst);
+  return 0;
+}
+
+__attribute__((target("avx2")))
+static int psx_frame_decode_avx2(const unsigned char *frame, struct psx_adpcm *adpcm, const struct audio_output *dst) {
+  const unsigned char predict = (frame[0] >> 4) & 0xF;
+  if (predict > 4) return -1;
+  
+  signed int excitation[32];
+  const __m128i mask = _mm_set1_epi8((char)0xF0);
+  const __m128i bytes = _mm_srli_si128(_mm_loadu_si128((const __m128i*)frame), 2);
+  const __m128i lo = _mm_and_si128(_mm_slli_epi16(bytes, 4), mask);
+  const __m128i hi = _mm_and_si128(bytes, mask);
+  const __m256i nibbles = _mm256_setr_m128i(_mm_unpacklo_epi8(lo, hi), _mm_unpackhi_epi8(lo, hi));
+  const __m128i shift = _mm_cvtsi32_si128(frame[0] & 0xF);
+  const __m256i n0 = _mm256_sra_epi16(_mm256_unpacklo_epi8(_mm256_setzero_si256(), nibbles), shift);
+  const __m256i n1 = _mm256_sra_epi16(_mm256_unpackhi_epi8(_mm256_setzero_si256(), nibbles), shift);
+  /* the unpacks work per 128-bit lane: n0 holds samples 0-7 and 16-23, n1 holds 8-15 and 24-31 */
+  const __m256i e0 = _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(n0)), 6);
+  const __m256i e1 = _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(n1)), 6);
+  const __m256i e2 = _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(n0, 1)), 6);
+  const __m256i e3 = _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(n1, 1)), 6);
+  _mm256_storeu_si256((__m256i*)(excitation +  0), e0);
+  _mm256_storeu_si256((__m256i*)(excitation +  8), e1);
+  _mm256_storeu_si256((__m256i*)(excitation + 16), e2);
+  _mm256_storeu_si256((__m256i*)(excitation + 24), e3);
+  
+  psx_frame_filter(excitation, adpcm, predict, dst);
+  return 0;
+}
+#endif
+
+/** Select the fastest frame decoder supported by the cpu. */
+static psx_frame_decoder psx_frame_decoder_select(void) {
+  static psx_frame_decoder decoder = NULL;
+  if (!decoder) {
+    decoder = psx_frame_decode_scalar;
+#if HX_X86
+    const unsigned int features = hx_cpu_features();
+    if (features & HX_CPU_SSE2) decoder = psx_frame_decode_sse2;
+    if (features & HX_CPU_AVX2) decoder = psx_frame_decode_avx2;
+#endif
+  }
+  return decoder;
+}
+
+static int psx_decoder_frame(HX_AudioDecoder *d, const struct audio_output *dst, unsigned int count) {
+  const psx_frame_decoder decode_frame = psx_frame_decoder_select();
+  for (int c = 0; c < d->info.num_channels; c++) {
+    const struct audio_output out = audio_output_channel(dst, c);
+    if (decode_frame(audio_decoder_frame_data(d, c), d->channels.psx + c, &out) != 0) return -1;
+  }
+  return 0;
+}
+
+static int psx_decoder_init(HX_AudioDecoder *d, const HX_AudioStream *in) {
+  memset(d->channels.psx, 0, sizeof(struct psx_adpcm) * d->info.num_channels);
+  d->info.num_samples = psx_sample_count(in->size, in->info.num_channels);
+  d->samples_per_frame = PSX_SAMPLES_PER_FRAME;
+  d->bytes_per_frame = PSX_BYTES_PER_FRAME;
+  d->src = (const unsigned char*)in->data;
+  d->decode = psx_decoder_frame;
   return 0;
 }
+
+
+/** Encoder candidate: filter and shift of a frame */
+struct psx_encode_candidate {
+  unsigned char predict, shift;
+};
+
+/**
+ * Quantize one sample like the decoder would reconstruct it.
+ * `pred` is the filter prediction in 1/64 units.
+ */
+static inline signed int psx_encode_quantize(signed int x, signed int pred, unsigned char shift, signed int *y) {
+  signed int n = ((x * 64 - pred) + (1 << (17 - shift))) >> (18 - shift);
+  n = max(-8, min(7, n));
+  const signed int t = (n << (12 - shift)) * 64 + pred;
+  *y = max(SHRT_MIN, min(SHRT_MAX, t / 64));
+  return n;
+}
+
+/**
+ * Squared error of encoding a frame with each candidate.
+ * `x` holds the 28 input samples, `history` the decoder history at the start of the frame.
+ */
+typedef void (*psx_encode_evaluator)(const signed int *x, const signed int history[2], const struct psx_encode_candidate *candidates, unsigned int count, float *errors);
+
+static void psx_encode_evaluate_scalar(const signed int *x, const signed int history[2], const struct psx_encode_candidate *candidates, unsigned int count, float *errors) {
+  for (unsigned int i = 0; i < count; i++) {
+    const signed int c1 = psx_adpcm_coefficients[candidates[i].predict][0];
+    const signed int c2 = psx_adpcm_coefficients[candidates[i].predict][1];
+    signed int hst1 = history[0], hst2 = history[1], y;
+    float error = 0.0f;
+    for (int s = 0; s < PSX_SAMPLES_PER_FRAME; s++) {
+      psx_encode_quantize(x[s], c1*hst1 + c2*hst2, candidates[i].shift, &y);
+      const float d = (float)(x[s] - y);
+      error += d * d;
+      hst2 = hst1;
+      hst1 = y;
+    }
+    errors[i] = error;
+  }
+}
+
+#if HX_X86
+/** Evaluates eight candidates at once, one per lane. */
+__attribute__((target("avx2")))
+static void psx_encode_evaluate_avx2(const signed int *x, const signed int history[2], const struct psx_encode_candidate *candidates, unsigned int count, float *errors) {
+  const __m256i nibble_min = _mm256_set1_epi32(-8), nibble_max = _mm256_set1_epi32(7);
+  const __m256i sample_min = _mm256_set1_epi32(SHRT_MIN), sample_max = _mm256_set1_epi32(SHRT_MAX);
+  const __m256i one = _mm256_set1_epi32(1), mask = _mm256_set1_epi32(63);
+  
+  for (unsigned int i = 0; i < count; i += 8) {
+    signed int c1[8], c2[8], shift[8];
+    for (unsigned int l = 0; l < 8; l++) {
+      const struct psx_encode_candidate *candidate = candidates + min(i + l, count - 1);
+      c1[l] = psx_adpcm_coefficients[candidate->predict][0];
+      c2[l] = psx_adpcm_coefficients[candidate->predict][1];
+      shift[l] = candidate->shift;
+    }
+    
+    const __m256i coef1 = _mm256_loadu_si256((const __m256i*)c1);
+    const __m256i coef2 = _mm256_loadu_si256((const __m256i*)c2);
+    const __m256i sh = _mm256_loadu_si256((const __m256i*)shift);
+    const __m256i round = _mm256_sllv_epi32(one, _mm256_sub_epi32(_mm256_set1_epi32(17), sh));
+    const __m256i quantize = _mm256_sub_epi32(_mm256_set1_epi32(18), sh);
+    const __m256i expand = _mm256_sub_epi32(_mm256_set1_epi32(12), sh);
+    __m256i hst1 = _mm256_set1_epi32(history[0]), hst2 = _mm256_set1_epi32(history[1]);
+    __m256 error = _mm256_setzero_ps();
+    
+    for (int s = 0; s < PSX_SAMPLES_PER_FRAME; s++) {
+      const __m256i xs = _mm256_set1_epi32(x[s]);
+      const __m256i pred = _mm256_add_epi32(_mm256_mullo_epi32(coef1, hst1), _mm256_mullo_epi32(coef2, hst2));
+      __m256i n = _mm256_srav_epi32(_mm256_add_epi32(_mm256_sub_epi32(_mm256_slli_epi32(xs, 6), pred), round), quantize);
+      n = _mm256_max_epi32(nibble_min, _mm256_min_epi32(nibble_max, n));
+      const __m256i t = _mm256_add_epi32(_mm256_slli_epi32(_mm256_sllv_epi32(n, expand), 6), pred);
+      /* divide by 64, truncating toward zero */
+      __m256i y = _mm256_srai_epi32(_mm256_add_epi32(t, _mm256_and_si256(_mm256_srai_epi32(t, 31), mask)), 6);
+      y = _mm256_max_epi32(sample_min, _mm256_min_epi32(sample_max, y));
+      const __m256 d = _mm256_cvtepi32_ps(_mm256_sub_epi32(xs, y));
+      error = _mm256_add_ps(error, _mm256_mul_ps(d, d));
+      hst2 = hst1;
+      hst1 = y;
+    }
+    
+    float e[8];
+    _mm256_storeu_ps(e, error);
+    for (unsigned int l = 0; l < 8 && i + l < count; l++) errors[i + l] = e[l];
+  }
+}
+#endif
+
+/** Select the fastest candidate evaluator supported by the cpu. */
+static psx_encode_evaluator psx_encode_evaluator_select(void) {
+  static psx_encode_evaluator evaluator = NULL;
+  if (!evaluator) {
+    evaluator = psx_encode_evaluate_scalar;
+#if HX_X86
+    if (hx_cpu_features() & HX_CPU_AVX2) evaluator = psx_encode_evaluate_avx2;
+#endif
+  }
+  return evaluator;
+}
+
+/**
+ * Fast mode: estimate the shift of every filter from the peak of its
+ * prediction residual over the input, and try it along with the next
+ * coarser shift. Exhaustive mode tries every filter with every shift.
+ */
+static unsigned int psx_encode_candidates(const signed int *x, const signed int history[2], enum HX_AudioEncodeMode mode, struct psx_encode_candidate *candidates) {
+  unsigned int count = 0;
+  for (unsigned char predict = 0; predict < 5; predict++) {
+    if (mode == HX_AUDIO_ENCODE_EXHAUSTIVE) {
+      for (unsigned char shift = 0; shift <= 12; shift++) {
+        candidates[count++] = (struct psx_encode_candidate){ predict, shift };
+      }
+    } else {
+      const signed int c1 = psx_adpcm_coefficients[predict][0];
+      const signed int c2 = psx_adpcm_coefficients[predict][1];
+      signed int hst1 = history[0], hst2 = history[1], peak = 0;
+      for (int s = 0; s < PSX_SAMPLES_PER_FRAME; s++) {
+        peak = max(peak, abs(x[s] - (c1*hst1 + c2*hst2) / 64));
+        hst2 = hst1;
+        hst1 = x[s];
+      }
+      
+      unsigned char range = 0;
+      while (range < 12 && peak > (7 << range)) range++;
+      candidates[count++] = (struct psx_encode_candidate){ predict, 12 - range };
+      if (range < 12) candidates[count++] = (struct psx_encode_candidate){ predict, 11 - range };
+    }
+  }
+  return count;
+}
+
+static void psx_frame_encode(const signed int *x, struct psx_adpcm *adpcm, enum HX_AudioEncodeMode mode, unsigned char frame[PSX_BYTES_PER_FRAME]) {
+  struct psx_encode_candidate candidates[5 * 13];
+  float errors[5 * 13];
+  const signed int history[2] = { adpcm->history1, adpcm->history2 };
+  const unsigned int count = psx_encode_candidates(x, history, mode, candidates);
+  psx_encode_evaluator_select()(x, history, candidates, count, errors);
+  
+  unsigned int best = 0;
+  for (unsigned int i = 1; i < count; i++) if (errors[i] < errors[best]) best = i;
+  
+  const struct psx_encode_candidate candidate = candidates[best];
+  const signed int c1 = psx_adpcm_coefficients[candidate.predict][0];
+  const signed int c2 = psx_adpcm_coefficients[candidate.predict][1];
+  signed int hst1 = adpcm->history1, hst2 = adpcm->history2, y;
+  
+  memset(frame, 0, PSX_BYTES_PER_FRAME);
+  frame[0] = (candidate.predict << 4) | candidate.shift;
+  for (int s = 0; s < PSX_SAMPLES_PER_FRAME; s++) {
+    const signed int n = psx_encode_quantize(x[s], c1*hst1 + c2*hst2, candidate.shift, &y);
+    frame[2 + s / 2] |= (n & 0xF) << ((s % 2) * 4);
+    hst2 = hst1;
+    hst1 = y;
+  }
+  
+  adpcm->history1 = hst1;
+  adpcm->history2 = hst2;
+}
+
+static HX_Size psx_encoded_size(const HX_AudioStream *in) {
+  const unsigned int ch = in->info.num_channels;
+  const unsigned int num_samples = ch ? in->size / sizeof(short) / ch : 0;
+  return (num_samples + PSX_SAMPLES_PER_FRAME - 1) / PSX_SAMPLES_PER_FRAME * PSX_BYTES_PER_FRAME * ch;
+}
+
+static int psx_encode_into(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode, void *buf, HX_Size cap) {
+  const unsigned int ch = in->info.num_channels;
+  if (ch == 0) return -1;
+  const unsigned int num_samples = in->size / sizeof(short) / ch;
+  const unsigned int num_frames = (num_samples + PSX_SAMPLES_PER_FRAME - 1) / PSX_SAMPLES_PER_FRAME;
+  if (cap < psx_encoded_size(in)) return HX_AUDIO_BUFFER_TOO_SMALL;
+  
+  audio_stream_info_copy(&out->info, &in->info);
+  out->info.fmt = HX_AUDIO_FORMAT_PSX;
+  out->info.endianness = HX_LITTLE_ENDIAN;
+  out->info.num_samples = num_frames * PSX_SAMPLES_PER_FRAME;
+  out->size = psx_encoded_size(in);
+  out->data = buf;
+  
+  struct psx_adpcm channels[ch];
+  memset(channels, 0, sizeof(channels));
+  
+  unsigned char *dst = (unsigned char*)out->data;
+  for (unsigned int n = 0; n < num_frames; n++) {
+    for (unsigned int c = 0; c < ch; c++, dst += PSX_BYTES_PER_FRAME) {
+      /* pad the last frame with silence */
+      signed int x[PSX_SAMPLES_PER_FRAME];
+      for (unsigned int s = 0; s < PSX_SAMPLES_PER_FRAME; s++) {
+        const unsigned int i = n * PSX_SAMPLES_PER_FRAME + s;
+        x[s] = (i < num_samples) ? in->data[i * ch + c] : 0;
+      }
+      psx_frame_encode(x, channels + c, mode, dst);
+    }
+  }
+  
+  return 0;
+}
+
+static int psx_encode(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode) {
+  return audio_encode_alloc(in, out, mode, psx_encoded_size(in), psx_encode_into);
+}
+
+
+#pragma mark - IMA ADPCM
+
+/**
+ * MS IMA ADPCM, in the block layout used on Xbox: every block starts with a
+ * 4-byte header for each channel (initial predictor and step index), followed
+ * by groups of 4 bytes (8 samples, low nibble first) alternating between channels.
+ */
+#define IMA_HEADER_SIZE 4
+#define IMA_BYTES_PER_BLOCK 0x24
+#define IMA_SAMPLES_PER_BLOCK 64
+
+static const signed int ima_step_table[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+  12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+static const signed int ima_index_table[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+struct ima_adpcm {
+  signed int predictor, step_index;
+};
+
+static HX_Size ima_sample_count(const HX_Size sz, const int ch) {
+  return sz / (IMA_BYTES_PER_BLOCK * ch) * IMA_SAMPLES_PER_BLOCK;
+}
+
+static void ima_adpcm_header_rw(unsigned char *p, struct ima_adpcm *ima, unsigned char mode) {
+  if (mode == STREAM_MODE_READ) {
+    ima->predictor = (signed short)(p[0] | p[1] << 8);
+    ima->step_index = min(p[2], 88);
+  } else {
+    p[0] = ima->predictor & 0xFF;
+    p[1] = (ima->predictor >> 8) & 0xFF;
+    p[2] = ima->step_index;
+    p[3] = 0;
+  }
+}
+
+static inline signed int ima_expand_nibble(struct ima_adpcm *ima, unsigned char nibble) {
+  const signed int step = ima_step_table[ima->step_index];
+  signed int diff = step >> 3;
+  if (nibble & 1) diff += step >> 2;
+  if (nibble & 2) diff += step >> 1;
+  if (nibble & 4) diff += step;
+  if (nibble & 8) diff = -diff;
+  ima->predictor = max(SHRT_MIN, min(SHRT_MAX, ima->predictor + diff));
+  ima->step_index = max(0, min(88, ima->step_index + ima_index_table[nibble]));
+  return ima->predictor;
+}
+
+/** Decode a whole block of all channels into `dst` */
+typedef void (*ima_block_decoder)(const unsigned char *block, unsigned int num_channels, const struct audio_output *dst);
+
+static void ima_block_decode_scalar(const unsigned char *block, unsigned int ch, const struct audio_output *dst) {
+  for (unsigned int c = 0; c < ch; c++) {
+    struct ima_adpcm ima;
+    const struct audio_output out = audio_output_channel(dst, c);
+    ima_adpcm_header_rw((unsigned char*)block + c * IMA_HEADER_SIZE, &ima, STREAM_MODE_READ);
+    const unsigned char *src = block + (ch + c) * IMA_HEADER_SIZE;
+    for (int s = 0; s < IMA_SAMPLES_PER_BLOCK; s += 8, src += ch * 4) {
+      for (int b = 0; b < 4; b++) {
+        audio_output_store(&out, s + b * 2 + 0, ima_expand_nibble(&ima, src[b] & 0xF));
+        audio_output_store(&out, s + b * 2 + 1, ima_expand_nibble(&ima, src[b] >> 4));
+      }
+    }
+  }
+}
+
+#if HX_X86
+/**
+ * The step index only depends on the codes, so it is resolved for the
+ * whole block first. The steps are then gathered and the differences
+ * computed eight samples at a time, leaving a single clamped sum.
+ */
+__attribute__((target("avx2")))
+static void ima_block_decode_avx2(const unsigned char *block, unsigned int ch, const struct audio_output *dst) {
+  const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(ch * 4));
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+  const __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2), four = _mm256_set1_epi32(4), eight = _mm256_set1_epi32(8);
+  
+  for (unsigned int c = 0; c < ch; c++) {
+    struct ima_adpcm ima;
+    ima_adpcm_header_rw((unsigned char*)block + c * IMA_HEADER_SIZE, &ima, STREAM_MODE_READ);
+    
+    /* collect the 8 groups of this channel and split them into nibbles */
+    unsigned char nibbles[IMA_SAMPLES_PER_BLOCK];
+    const __m256i groups = _mm256_i32gather_epi32((const int*)(block + (ch + c) * IMA_HEADER_SIZE), offsets, 1);
+    const __m256i lo = _mm256_and_si256(groups, mask), hi = _mm256_and_si256(_mm256_srli_epi16(groups, 4), mask);
+    const __m256i n0 = _mm256_unpacklo_epi8(lo, hi), n1 = _mm256_unpackhi_epi8(lo, hi);
+    _mm256_storeu_si256((__m256i*)(nibbles +  0), _mm256_permute2x128_si256(n0, n1, 0x20));
+    _mm256_storeu_si256((__m256i*)(nibbles + 32), _mm256_permute2x128_si256(n0, n1, 0x31));
+    
+    signed int index[IMA_SAMPLES_PER_BLOCK];
+    for (int s = 0; s < IMA_SAMPLES_PER_BLOCK; s++) {
+      index[s] = ima.step_index;
+      ima.step_index = max(0, min(88, ima.step_index + ima_index_table[nibbles[s]]));
+    }
+    
+    signed int diff[IMA_SAMPLES_PER_BLOCK];
+    for (int s = 0; s < IMA_SAMPLES_PER_BLOCK; s += 8) {
+      const __m256i n = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(nibbles + s)));
+      const __m256i step = _mm256_i32gather_epi32(ima_step_table, _mm256_loadu_si256((const __m256i*)(index + s)), 4);
+      __m256i d = _mm256_srli_epi32(step, 3);
+      d = _mm256_add_epi32(d, _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(n, one), one), _mm256_srli_epi32(step, 2)));
+      d = _mm256_add_epi32(d, _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(n, two), two), _mm256_srli_epi32(step, 1)));
+      d = _mm256_add_epi32(d, _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(n, four), four), step));
+      const __m256i sign = _mm256_cmpeq_epi32(_mm256_and_si256(n, eight), eight);
+      _mm256_storeu_si256((__m256i*)(diff + s), _mm256_sub_epi32(_mm256_xor_si256(d, sign), sign));
+    }
+    
+    signed int predictor = ima.predictor;
+    const struct audio_output out = audio_output_channel(dst, c);
+    for (int s = 0; s < IMA_SAMPLES_PER_BLOCK; s++) {
+      predictor = max(SHRT_MIN, min(SHRT_MAX, predictor + diff[s]));
+      audio_output_store(&out, s, predictor);
+    }
+  }
+}
+#endif
+
+/** Select the fastest block decoder supported by the cpu. */
+static ima_block_decoder ima_block_decoder_select(void) {
+  static ima_block_decoder decoder = NULL;
+  if (!decoder) {
+    decoder = ima_block_decode_scalar;
+#if HX_X86
+    if (hx_cpu_features() & HX_CPU_AVX2) decoder = ima_block_decode_avx2;
+#endif
+  }
+  return decoder;
+}
+
+static int ima_decoder_frame(HX_AudioDecoder *d, const struct audio_output *dst, unsigned int count) {
+  const ima_block_decoder decode_block = ima_block_decoder_select();
+  const unsigned char *src = audio_decoder_frame_data(d, 0);
+  const unsigned int ch = d->info.num_channels;
+  
+  if (count == IMA_SAMPLES_PER_BLOCK) {
+    decode_block(src, ch, dst);
+  } else {
+    signed short block[IMA_SAMPLES_PER_BLOCK * ch];
+    const struct audio_output tmp = audio_output_interleaved(block, ch);
+    decode_block(src, ch, &tmp);
+    for (unsigned int c = 0; c < ch; c++) {
+      const struct audio_output out = audio_output_channel(dst, c);
+      for (unsigned int s = 0; s < count; s++) audio_output_store(&out, s, block[s * ch + c]);
+    }
+  }
+  return 0;
+}
+
+static int ima_decoder_init(HX_AudioDecoder *d, const HX_AudioStream *in) {
+  d->info.num_samples = ima_sample_count(in->size, in->info.num_channels);
+  d->samples_per_frame = IMA_SAMPLES_PER_BLOCK;
+  d->bytes_per_frame = IMA_BYTES_PER_BLOCK;
+  d->src = (const unsigned char*)in->data;
+  d->decode = ima_decoder_frame;
+  return 0;
+}
+
+/** Find the code that best approximates `sample` and advance the state like the decoder. */
+static inline unsigned char ima_encode_sample(struct ima_adpcm *ima, signed int sample) {
+  signed int step = ima_step_table[ima->step_index];
+  signed int diff = sample - ima->predictor;
+  unsigned char nibble = 0;
+  
+  if (diff < 0) {
+    nibble = 8;
+    diff = -diff;
+  }
+  
+  if (diff >= step) { nibble |= 4; diff -= step; }
+  step >>= 1;
+  if (diff >= step) { nibble |= 2; diff -= step; }
+  step >>= 1;
+  if (diff >= step) { nibble |= 1; }
+  
+  ima_expand_nibble(ima, nibble);
+  return nibble;
+}
+
+static HX_Size ima_encoded_size(const HX_AudioStream *in) {
+  const unsigned int ch = in->info.num_channels;
+  const unsigned int num_samples = ch ? in->size / sizeof(short) / ch : 0;
+  return (num_samples + IMA_SAMPLES_PER_BLOCK - 1) / IMA_SAMPLES_PER_BLOCK * IMA_BYTES_PER_BLOCK * ch;
+}
+
+/* IMA has no choices to search, so the mode is ignored. */
+static int ima_encode_into(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode, void *buf, HX_Size cap) {
+  const unsigned int ch = in->info.num_channels;
+  if (ch == 0) return -1;
+  const unsigned int num_samples = in->size / sizeof(short) / ch;
+  const unsigned int num_blocks = (num_samples + IMA_SAMPLES_PER_BLOCK - 1) / IMA_SAMPLES_PER_BLOCK;
+  if (cap < ima_encoded_size(in)) return HX_AUDIO_BUFFER_TOO_SMALL;
+  
+  audio_stream_info_copy(&out->info, &in->info);
+  out->info.fmt = HX_AUDIO_FORMAT_IMA;
+  out->info.endianness = HX_LITTLE_ENDIAN;
+  out->info.num_samples = num_blocks * IMA_SAMPLES_PER_BLOCK;
+  out->size = ima_encoded_size(in);
+  out->data = buf;
+  
+  struct ima_adpcm state[ch];
+  memset(state, 0, sizeof(state));
+  
+  const signed short *src = in->data;
+  unsigned char *dst = (unsigned char*)out->data;
+  for (unsigned int n = 0; n < num_blocks; n++, dst += IMA_BYTES_PER_BLOCK * ch) {
+    for (unsigned int c = 0; c < ch; c++) {
+      struct ima_adpcm *ima = state + c;
+      ima_adpcm_header_rw(dst + c * IMA_HEADER_SIZE, ima, STREAM_MODE_WRITE);
+      
+      unsigned char *p = dst + (ch + c) * IMA_HEADER_SIZE;
+      for (unsigned int s = 0; s < IMA_SAMPLES_PER_BLOCK; s += 2) {
+        /* pad the last block with silence */
+        const unsigned int i = n * IMA_SAMPLES_PER_BLOCK + s;
+        const unsigned char lo = ima_encode_sample(ima, (i + 0 < num_samples) ? src[(i + 0) * ch + c] : 0);
+        const unsigned char hi = ima_encode_sample(ima, (i + 1 < num_samples) ? src[(i + 1) * ch + c] : 0);
+        p[(s % 8) / 2] = lo | (hi << 4);
+        if (s % 8 == 6) p += ch * 4;
+      }
+    }
+  }
+  
+  return 0;
+}
+
+static int ima_encode(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode) {
+  return audio_encode_alloc(in, out, mode, ima_encoded_size(in), ima_encode_into);
+}
+
+
+#pragma mark - PCM
+
+static int pcm_decoder_frame(HX_AudioDecoder *d, const struct audio_output *dst, unsigned int count) {
+  const unsigned int ch = d->info.num_channels;
+  const signed short *src = (const signed short*)audio_decoder_frame_data(d, 0);
+  if (!dst->f32 && dst->stride == ch && dst->channel_stride == 1) {
+    memcpy(dst->dst, src, count * ch * sizeof(short));
+  } else {
+    for (unsigned int c = 0; c < ch; c++) {
+      const struct audio_output out = audio_output_channel(dst, c);
+      for (unsigned int s = 0; s < count; s++) audio_output_store(&out, s, src[s * ch + c]);
+    }
+  }
+  return 0;
+}
+
+static int pcm_decoder_init(HX_AudioDecoder *d, const HX_AudioStream *in) {
+  d->info.num_samples = in->size / sizeof(short) / in->info.num_channels;
+  d->samples_per_frame = PSX_SAMPLES_PER_FRAME;
+  d->bytes_per_frame = PSX_SAMPLES_PER_FRAME * sizeof(short);
+  d->src = (const unsigned char*)in->data;
+  d->decode = pcm_decoder_frame;
+  return 0;
+}
+
+
+#pragma mark - Decoder
+
+/** Size of the state of one channel, or -1 if the format cannot be decoded. */
+static int audio_decoder_state_size(enum HX_AudioFormat fmt, size_t *size) {
+  switch (fmt) {
+    case HX_AUDIO_FORMAT_PCM: *size = 0; return 0;
+    case HX_AUDIO_FORMAT_DSP: *size = sizeof(struct dsp_adpcm); return 0;
+    case HX_AUDIO_FORMAT_PSX: *size = sizeof(struct psx_adpcm); return 0;
+    case HX_AUDIO_FORMAT_IMA: *size = 0; return 0;
+    default: return -1;
+  }
+}
+
+/**
+ * Set up a decoder with caller-provided channel state and frame buffer.
+ * The frame buffer holds one frame of every channel, and may be NULL if
+ * only whole frames are read.
+ */
+static int audio_decoder_init(HX_AudioDecoder *d, const HX_AudioStream *in, void *channels, signed short *buffer) {
+  memset(d, 0, sizeof(*d));
+  d->stream = in;
+  audio_stream_info_copy(&d->info, &in->info);
+  d->info.fmt = HX_AUDIO_FORMAT_PCM;
+  d->channels.dsp = channels;
+  d->buffer = buffer;
+  d->end = (const unsigned char*)in->data + in->size;
+  
+  if (in->info.fmt == HX_AUDIO_FORMAT_PCM) return pcm_decoder_init(d, in);
+  if (in->info.fmt == HX_AUDIO_FORMAT_DSP) return dsp_decoder_init(d, in);
+  if (in->info.fmt == HX_AUDIO_FORMAT_PSX) return psx_decoder_init(d, in);
+  if (in->info.fmt == HX_AUDIO_FORMAT_IMA) return ima_decoder_init(d, in);
+  return -1;
+}
+
+HX_AudioDecoder *hx_audio_decoder_alloc(const HX_AudioStream *in) {
+  size_t state_size;
+  if (audio_decoder_state_size(in->info.fmt, &state_size) != 0) return NULL;
+  if (!in->data || in->info.num_channels == 0) return NULL;
+  
+  /* decoder, channel state, frame buffer and loop history in a single block */
+  const unsigned int max_samples_per_frame = IMA_SAMPLES_PER_BLOCK;
+  const size_t header_size = (sizeof(HX_AudioDecoder) + 7) & ~(size_t)7;
+  const size_t channels_size = (state_size * in->info.num_channels + 7) & ~(size_t)7;
+  const size_t buffer_size = max_samples_per_frame * in->info.num_channels * sizeof(short);
+  HX_AudioDecoder *d = malloc(header_size + channels_size + buffer_size + in->info.num_channels * 2 * sizeof(short));
+  if (!d) return NULL;
+  
+  if (audio_decoder_init(d, in, (char*)d + header_size, (signed short*)((char*)d + header_size + channels_size)) != 0) {
+    free(d);
+    return NULL;
+  }
+  d->loop_history = (signed short*)((char*)d + header_size + channels_size + buffer_size);
+  
+  return d;
+}
+
+static void audio_decoder_get_history(const HX_AudioDecoder *d, unsigned int c, signed short history[2]) {
+  if (d->stream->info.fmt == HX_AUDIO_FORMAT_DSP) {
+    history[0] = d->channels.dsp[c].history1;
+    history[1] = d->channels.dsp[c].history2;
+  } else if (d->stream->info.fmt == HX_AUDIO_FORMAT_PSX) {
+    history[0] = d->channels.psx[c].history1;
+    history[1] = d->channels.psx[c].history2;
+  }
+}
+
+static void audio_decoder_set_history(HX_AudioDecoder *d, unsigned int c, const signed short history[2]) {
+  if (d->stream->info.fmt == HX_AUDIO_FORMAT_DSP) {
+    d->channels.dsp[c].history1 = history[0];
+    d->channels.dsp[c].history2 = history[1];
+  } else if (d->stream->info.fmt == HX_AUDIO_FORMAT_PSX) {
+    d->channels.psx[c].history1 = history[0];
+    d->channels.psx[c].history2 = history[1];
+  }
+}
+
+/** Predictor history at the start of the stream */
+static void audio_decoder_reset_history(HX_AudioDecoder *d) {
+  for (unsigned int c = 0; c < d->info.num_channels; c++) {
+    signed short history[2] = { 0, 0 };
+    if (d->stream->info.fmt == HX_AUDIO_FORMAT_DSP) {
+      history[0] = d->channels.dsp[c].hst1;
+      history[1] = d->channels.dsp[c].hst2;
+    }
+    audio_decoder_set_history(d, c, history);
+  }
+}
+
+/** Sample position of a DSP nibble address */
+static HX_Size dsp_nibble_to_sample(unsigned int nibble) {
+  const unsigned int offset = nibble % 16;
+  return (nibble / 16) * DSP_SAMPLES_PER_FRAME + (offset < 2 ? 0 : offset - 2);
+}
+
+/**
+ * Find the loop region of a stream: the loop addresses of the DSP header,
+ * or the loop start and repeating loop end flags of the first PSX channel.
+ */
+static int audio_decoder_find_loop(const HX_AudioDecoder *d, HX_Size *start, HX_Size *end) {
+  if (d->stream->info.fmt == HX_AUDIO_FORMAT_DSP) {
+    const struct dsp_adpcm *adpcm = d->channels.dsp;
+    if (!adpcm->loop_flag) return -1;
+    *start = dsp_nibble_to_sample(adpcm->loop_start);
+    *end = min(dsp_nibble_to_sample(adpcm->loop_end) + 1, d->info.num_samples);
+  } else if (d->stream->info.fmt == HX_AUDIO_FORMAT_PSX) {
+    const HX_Size num_frames = (d->end - d->src) / (d->info.num_channels * PSX_BYTES_PER_FRAME);
+    HX_Size start_frame = 0, frame;
+    for (frame = 0; frame < num_frames; frame++) {
+      const unsigned char flags = d->src[frame * d->info.num_channels * PSX_BYTES_PER_FRAME + 1];
+      if (flags & PSX_FLAG_LOOP_START) start_frame = frame;
+      if ((flags & (PSX_FLAG_LOOP_END | PSX_FLAG_LOOP_REPEAT)) == (PSX_FLAG_LOOP_END | PSX_FLAG_LOOP_REPEAT)) break;
+    }
+    if (frame == num_frames) return -1;
+    *start = start_frame * PSX_SAMPLES_PER_FRAME;
+    *end = min((frame + 1) * PSX_SAMPLES_PER_FRAME, d->info.num_samples);
+  } else {
+    return -1;
+  }
+  return (*start < *end) ? 0 : -1;
+}
+
+/** Save the predictor history if the decoder is at the first frame of the loop */
+static void audio_decoder_loop_save(HX_AudioDecoder *d) {
+  if (!d->loop_history || d->loop_saved || d->loop_end == 0) return;
+  if (d->frame != d->loop_start / d->samples_per_frame) return;
+  for (unsigned int c = 0; c < d->info.num_channels; c++) audio_decoder_get_history(d, c, d->loop_history + c * 2);
+  d->loop_saved = 1;
+}
+
+/** Continue decoding at the loop start, restoring the saved predictor history */
+static int audio_decoder_loop_restart(HX_AudioDecoder *d) {
+  const HX_Size frame = d->loop_start / d->samples_per_frame;
+  
+  if (!d->loop_saved) {
+    /* the loop start was skipped by a seek; decode up to it once */
+    audio_decoder_reset_history(d);
+    for (d->frame = 0; d->frame < frame; d->frame++) {
+      if (audio_decoder_decode(d, d->buffer, d->samples_per_frame) != 0) return -1;
+    }
+    audio_decoder_loop_save(d);
+  }
+  
+  for (unsigned int c = 0; c < d->info.num_channels; c++) audio_decoder_set_history(d, c, d->loop_history + c * 2);
+  d->frame = frame;
+  d->buffer_pos = d->buffer_len = 0;
+  
+  if (d->loop_start % d->samples_per_frame) {
+    /* decode the frame containing the loop start and skip to it */
+    const unsigned int count = min(d->samples_per_frame, d->loop_end - frame * d->samples_per_frame);
+    if (audio_decoder_decode(d, d->buffer, count) != 0) return -1;
+    d->buffer_pos = d->loop_start % d->samples_per_frame;
+    d->buffer_len = count;
+    d->frame++;
+  }
+  
+  return 0;
+}
+
+int hx_audio_decoder_set_loop(HX_AudioDecoder *d, int loop) {
+  if (!loop) {
+    d->loop = 0;
+    return 0;
+  }
+  
+  HX_Size start, end;
+  if (!d->loop_history || audio_decoder_find_loop(d, &start, &end) != 0) return -1;
+  if (start != d->loop_start || end != d->loop_end) {
+    d->loop_start = start;
+    d->loop_end = end;
+    d->loop_saved = 0;
+    /* the dsp header stores the history at the loop start */
+    if (d->stream->info.fmt == HX_AUDIO_FORMAT_DSP && start % DSP_SAMPLES_PER_FRAME == 0) {
+      for (unsigned int c = 0; c < d->info.num_channels; c++) {
+        d->loop_history[c * 2 + 0] = d->channels.dsp[c].loop_hst1;
+        d->loop_history[c * 2 + 1] = d->channels.dsp[c].loop_hst2;
+      }
+      d->loop_saved = 1;
+    }
+  }
+  
+  d->loop = 1;
+  return 0;
+}
+
+int hx_audio_decoder_loop_points(const HX_AudioDecoder *d, HX_Size *start, HX_Size *end) {
+  return audio_decoder_find_loop(d, start, end);
+}
+
+const struct HX_AudioStreamInfo *hx_audio_decoder_info(const HX_AudioDecoder *d) {
+  return &d->info;
+}
+
+/** Read the next `num_samples` samples per channel into `out` */
+static int audio_decoder_read(HX_AudioDecoder *d, const struct audio_output *out, HX_Size num_samples) {
+  const unsigned int ch = d->info.num_channels;
+  HX_Size done = 0;
+  
+  while (done < num_samples) {
+    /* drain the remainder of a partially read frame */
+    if (d->buffer_pos < d->buffer_len) {
+      unsigned int n = min(d->buffer_len - d->buffer_pos, num_samples - done);
+      if (!out->f32 && out->stride == ch && out->channel_stride == 1) {
+        memcpy((signed short*)out->dst + done * ch, d->buffer + d->buffer_pos * ch, n * ch * sizeof(short));
+      } else {
+        for (unsigned int c = 0; c < ch; c++) {
+          const struct audio_output o = audio_output_channel(out, c);
+          for (unsigned int s = 0; s < n; s++) audio_output_store(&o, done + s, d->buffer[(d->buffer_pos + s) * ch + c]);
+        }
+      }
+      d->buffer_pos += n;
+      done += n;
+      continue;
+    }
+    
+    const HX_Size position = d->frame * d->samples_per_frame;
+    const HX_Size end = d->loop ? d->loop_end : d->info.num_samples;
+    if (position >= end) {
+      if (!d->loop) break;
+      if (audio_decoder_loop_restart(d) != 0) return -1;
+      continue;
+    }
+    
+    audio_decoder_loop_save(d);
+    const unsigned int count = min(d->samples_per_frame, end - position);
+    if (count == d->samples_per_frame && num_samples - done >= count) {
+      /* whole frames are decoded directly into the output */
+      const struct audio_output o = audio_output_offset(out, done);
+      if (d->decode(d, &o, count) != 0) return -1;
+      done += count;
+    } else {
+      if (audio_decoder_decode(d, d->buffer, count) != 0) return -1;
+      d->buffer_pos = 0;
+      d->buffer_len = count;
+    }
+    d->frame++;
+  }
+  
+  return (int)done;
+}
+
+int hx_audio_decoder_read(HX_AudioDecoder *d, signed short *buf, HX_Size num_samples) {
+  const struct audio_output out = audio_output_interleaved(buf, d->info.num_channels);
+  return audio_decoder_read(d, &out, num_samples);
+}
+
+int hx_audio_decoder_set_sample_format(HX_AudioDecoder *d, enum HX_SampleFormat format) {
+  if (format > HX_SAMPLE_FORMAT_F32_PLANAR) return -1;
+  d->sample_format = format;
+  return 0;
+}
+
+int hx_audio_decoder_read_samples(HX_AudioDecoder *d, void *buf, HX_Size num_samples) {
+  const unsigned int ch = d->info.num_channels;
+  struct audio_output out;
+  out.dst = buf;
+  out.f32 = d->sample_format == HX_SAMPLE_FORMAT_F32 || d->sample_format == HX_SAMPLE_FORMAT_F32_PLANAR;
+  if (d->sample_format == HX_SAMPLE_FORMAT_S16_PLANAR || d->sample_format == HX_SAMPLE_FORMAT_F32_PLANAR) {
+    /* channel planes are contiguous, each `num_samples` long */
+    out.stride = 1;
+    out.channel_stride = num_samples;
+  } else {
+    out.stride = ch;
+    out.channel_stride = 1;
+  }
+  return audio_decoder_read(d, &out, num_samples);
+}
+
+void hx_audio_decoder_free(HX_AudioDecoder **d) {
+  free(*d);
+  *d = NULL;
+}
+
+#pragma mark - Seek table
+
+/**
+ * Predictor history at the start of every frame. At 4 bytes per channel and frame, the
+ * table is a half of the size of a DSP stream and a quarter of a PSX stream, and a seek
+ * decodes at most the single frame containing the sample.
+ */
+struct audio_seek_table {
+  /** Number of entries, one per frame */
+  HX_Size num_entries;
+  /** Predictor history, [frame][channel][2] */
+  signed short history[];
+};
+
+/** Number of codec frames in the decoded stream */
+static HX_Size audio_decoder_num_frames(const HX_AudioDecoder *d) {
+  return (d->info.num_samples + d->samples_per_frame - 1) / d->samples_per_frame;
+}
+
+/** Decode the whole stream once, saving the predictor history before every frame. */
+static struct audio_seek_table *audio_seek_table_build(const HX_AudioStream *stream) {
+  HX_AudioDecoder *d = hx_audio_decoder_alloc(stream);
+  if (!d) return NULL;
+  
+  const unsigned int ch = d->info.num_channels;
+  const HX_Size num_frames = audio_decoder_num_frames(d);
+  struct audio_seek_table *table = malloc(sizeof(*table) + num_frames * ch * 2 * sizeof(short));
+  if (!table) goto fail;
+  table->num_entries = num_frames;
+  
+  for (; d->frame < num_frames; d->frame++) {
+    signed short *entry = table->history + d->frame * ch * 2;
+    for (unsigned int c = 0; c < ch; c++) audio_decoder_get_history(d, c, entry + c * 2);
+    const unsigned int count = min(d->samples_per_frame, d->info.num_samples - d->frame * d->samples_per_frame);
+    if (audio_decoder_decode(d, d->buffer, count) != 0) {
+      free(table);
+      goto fail;
+    }
+  }
+  
+  hx_audio_decoder_free(&d);
+  return table;
+fail:
+  hx_audio_decoder_free(&d);
+  return NULL;
+}
+
+/**
+ * Seek table of a stream, built on first use. Decoders of the same stream may build
+ * it concurrently: every one of them builds its own table, and the first one stored
+ * in the stream is kept.
+ */
+static const struct audio_seek_table *audio_seek_table_get(HX_AudioStream *stream) {
+  struct audio_seek_table *table = __atomic_load_n(&stream->_seek_table, __ATOMIC_ACQUIRE);
+  if (table || !(table = audio_seek_table_build(stream))) return table;
+  
+  void *stored = NULL;
+  if (!__atomic_compare_exchange_n(&stream->_seek_table, &stored, table, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(table);
+    table = stored;
+  }
+  return table;
+}
+
+int hx_audio_stream_seek(HX_AudioStream *stream, HX_AudioDecoder *d, HX_Size sample) {
+  if (d->stream != stream || sample > d->info.num_samples) return -1;
+  
+  const unsigned int ch = d->info.num_channels;
+  const HX_Size frame = sample / d->samples_per_frame;
+  d->buffer_pos = d->buffer_len = 0;
+  
+  /* pcm and ima frames can be decoded without history */
+  if (stream->info.fmt == HX_AUDIO_FORMAT_DSP || stream->info.fmt == HX_AUDIO_FORMAT_PSX) {
+    const struct audio_seek_table *table = audio_seek_table_get(stream);
+    if (!table) return -1;
+    /* restore the history saved before the frame, there is none past the end */
+    if (frame < table->num_entries)
+      for (unsigned int c = 0; c < ch; c++) audio_decoder_set_history(d, c, table->history + (frame * ch + c) * 2);
+  }
+  
+  d->frame = frame;
+  if (sample == d->info.num_samples) {
+    d->frame = audio_decoder_num_frames(d);
+  } else if (sample % d->samples_per_frame) {
+    /* decode the frame containing the sample and skip to it */
+    const unsigned int count = min(d->samples_per_frame, d->info.num_samples - frame * d->samples_per_frame);
+    if (audio_decoder_decode(d, d->buffer, count) != 0) return -1;
+    d->buffer_pos = sample % d->samples_per_frame;
+    d->buffer_len = count;
+    d->frame++;
+  }
+  
+  return 0;
+}
+
+/** Size of a decoded stream, padded to whole codec frames. */
+static HX_Size audio_decoder_pcm_size(const HX_AudioDecoder *d) {
+  return audio_decoder_num_frames(d) * d->samples_per_frame * sizeof(short) * d->info.num_channels;
+}
+
+/** Allocate the output of a full decode, zeroing the padding after the last sample. */
+static int audio_decoder_output_alloc(const HX_AudioDecoder *d, HX_AudioStream *out) {
+  const HX_Size used = d->info.num_samples * sizeof(short) * d->info.num_channels;
+  audio_stream_info_copy(&out->info, &d->info);
+  out->size = audio_decoder_pcm_size(d);
+  if (!(out->data = malloc(out->size))) return -1;
+  memset((char*)out->data + used, 0, out->size - used);
+  return 0;
+}
+
+/** Decode an entire stream into a newly allocated buffer. */
+static int audio_decode(const HX_AudioStream *in, HX_AudioStream *out) {
+  HX_AudioDecoder *decoder = hx_audio_decoder_alloc(in);
+  if (!decoder) return -1;
+  
+  int result = audio_decoder_output_alloc(decoder, out);
+  if (result == 0) result = hx_audio_decoder_read(decoder, out->data, decoder->info.num_samples);
+  hx_audio_decoder_free(&decoder);
+  return (result < 0) ? -1 : 0;
+}
+
+
+/**
+ * Decode an entire stream into a caller-supplied buffer, without allocating.
+ * The channel state lives on the stack, and every frame is decoded straight
+ * into the output, which is padded to whole frames.
+ */
+static int audio_decode_into(const HX_AudioStream *in, HX_AudioStream *out, void *buf, HX_Size cap) {
+  size_t state_size;
+  if (audio_decoder_state_size(in->info.fmt, &state_size) != 0) return -1;
+  if (!in->data || in->info.num_channels == 0) return -1;
+  
+  /* large enough for the state of any decoder */
+  struct dsp_adpcm channels[in->info.num_channels];
+  HX_AudioDecoder d;
+  if (audio_decoder_init(&d, in, channels, NULL) != 0) return -1;
+  
+  const unsigned int ch = d.info.num_channels;
+  const HX_Size size = audio_decoder_pcm_size(&d);
+  if (cap < size) return HX_AUDIO_BUFFER_TOO_SMALL;
+  
+  signed short *dst = buf;
+  for (HX_Size position = 0; position < d.info.num_samples; position += d.samples_per_frame, d.frame++) {
+    const unsigned int count = min(d.samples_per_frame, d.info.num_samples - position);
+    if (audio_decoder_decode(&d, dst + position * ch, count) != 0) return -1;
+  }
+  
+  /* some decoders write the padding of the last frame */
+  const HX_Size used = d.info.num_samples * sizeof(short) * ch;
+  memset((char*)buf + used, 0, size - used);
+  
+  audio_stream_info_copy(&out->info, &d.info);
+  out->data = buf;
+  out->size = size;
+  return 0;
+}
+
+
+#pragma mark - Resampling
+
+/** Taps of every polyphase filter */
+#define RESAMPLE_TAPS 16
+/** Maximum number of filter phases, finer ratios use the nearest phase */
+#define RESAMPLE_MAX_PHASES 1024
+/** Number of input samples decoded at a time */
+#define RESAMPLE_BLOCK_SIZE 1024
+
+/** Filter one output sample from RESAMPLE_TAPS input samples. */
+typedef float resample_dot_product(const float *x, const float *h);
+
+static float resample_dot_product_scalar(const float *x, const float *h) {
+  /* same order of additions as the vector version */
+  float lanes[8], sums[4];
+  for (int j = 0; j < 8; j++) lanes[j] = x[j] * h[j] + x[j + 8] * h[j + 8];
+  for (int j = 0; j < 4; j++) sums[j] = lanes[j] + lanes[j + 4];
+  return (sums[0] + sums[2]) + (sums[1] + sums[3]);
+}
+
+#if HX_X86
+__attribute__((target("avx2")))
+static float resample_dot_product_avx2(const float *x, const float *h) {
+  __m256 acc = _mm256_mul_ps(_mm256_loadu_ps(x), _mm256_loadu_ps(h));
+  acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + 8), _mm256_loadu_ps(h + 8)));
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+#endif
+
+/** Select the fastest filter kernel supported by the cpu. */
+static resample_dot_product* resample_dot_product_select(void) {
+  static resample_dot_product* kernel = NULL;
+  if (!kernel) {
+    kernel = resample_dot_product_scalar;
+#if HX_X86
+    if (hx_cpu_features() & HX_CPU_AVX2) kernel = resample_dot_product_avx2;
+#endif
+  }
+  return kernel;
+}
+
+static unsigned int resample_gcd(unsigned int a, unsigned int b) {
+  while (b) {
+    unsigned int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/**
+ * Blackman-windowed sinc filters, one for every phase. Output sample n
+ * is at input position n * down / up, and the first tap of its filter
+ * is RESAMPLE_TAPS / 2 - 1 samples before it. Every phase has unity gain.
+ */
+static void resample_filter_init(float *coefs, unsigned int num_phases, unsigned int up, unsigned int down) {
+  const double pi = 3.14159265358979323846;
+  const double cutoff = (up < down) ? (double)up / down : 1.0;
+  for (unsigned int p = 0; p < num_phases; p++) {
+    float *h = coefs + p * RESAMPLE_TAPS;
+    double h64[RESAMPLE_TAPS], sum = 0.0;
+    for (int k = 0; k < RESAMPLE_TAPS; k++) {
+      const double d = (k - (RESAMPLE_TAPS / 2 - 1)) - (double)p / num_phases;
+      const double x = pi * cutoff * d;
+      const double w = 0.42 + 0.5 * cos(2.0 * pi * d / RESAMPLE_TAPS) + 0.08 * cos(4.0 * pi * d / RESAMPLE_TAPS);
+      h64[k] = ((x == 0.0) ? 1.0 : sin(x) / x) * w;
+      sum += h64[k];
+    }
+    for (int k = 0; k < RESAMPLE_TAPS; k++) h[k] = (float)(h64[k] / sum);
+  }
+}
+
+/** Whether the output stream asks for a different sample rate or channel count. */
+static int audio_resample_needed(const struct HX_AudioStreamInfo *in, const struct HX_AudioStreamInfo *out) {
+  return (out->sample_rate && out->sample_rate != in->sample_rate)
+  || (out->num_channels && out->num_channels != in->num_channels);
+}
+
+/**
+ * Decode a stream to PCM at the sample rate and channel count of the output
+ * stream. Blocks of decoded samples are mixed to the smaller of the two
+ * channel counts and resampled as they come out of the decoder, so the
+ * output is the only allocation proportional to the stream length.
+ * Downmixing averages input channel c into output channel c % out_ch;
+ * upmixing repeats the input channels.
+ */
+static int audio_resample(const HX_AudioStream *in, HX_AudioStream *out) {
+  HX_AudioDecoder *d = hx_audio_decoder_alloc(in);
+  if (!d) return -1;
+  
+  const unsigned int in_ch = d->info.num_channels, in_rate = d->info.sample_rate;
+  const unsigned int out_ch = out->info.num_channels ? out->info.num_channels : in_ch;
+  const unsigned int out_rate = out->info.sample_rate ? out->info.sample_rate : in_rate;
+  const unsigned int work_ch = min(in_ch, out_ch);
+  if (in_rate == 0) {
+    hx_audio_decoder_free(&d);
+    return -1;
+  }
+  
+  const unsigned int g = resample_gcd(out_rate, in_rate);
+  const unsigned int up = out_rate / g, down = in_rate / g;
+  const unsigned int num_phases = min(up, RESAMPLE_MAX_PHASES);
+  const HX_Size num_in = d->info.num_samples;
+  const HX_Size num_out = (HX_Size)(((unsigned long long)num_in * up + down - 1) / down);
+  /* one more sample for a phase rounded up to the next input sample */
+  const unsigned int capacity = RESAMPLE_BLOCK_SIZE + RESAMPLE_TAPS + 1;
+  
+  /* filters, planar channel buffers and the decoded block */
+  float *coefs = malloc(num_phases * RESAMPLE_TAPS * sizeof(float) + work_ch * capacity * sizeof(float) + RESAMPLE_BLOCK_SIZE * in_ch * sizeof(short));
+  signed short *data = malloc(max(num_out * out_ch * sizeof(short), 1));
+  if (!coefs || !data) {
+    free(coefs);
+    free(data);
+    hx_audio_decoder_free(&d);
+    return -1;
+  }
+  
+  float *planar = coefs + num_phases * RESAMPLE_TAPS;
+  signed short *block = (signed short*)(planar + work_ch * capacity);
+  resample_filter_init(coefs, num_phases, up, down);
+  resample_dot_product* dot = resample_dot_product_select();
+  
+  /* the filter of the first output sample starts before the first input sample */
+  unsigned int fill = RESAMPLE_TAPS / 2 - 1, pos = 0;
+  unsigned long long frac = 0;
+  memset(planar, 0, work_ch * capacity * sizeof(float));
+  
+  HX_Size n;
+  for (n = 0; n < num_out; n++) {
+    while (pos + RESAMPLE_TAPS + 1 > fill) {
+      if (pos >= fill) {
+        /* downsampling by a large factor can skip input */
+        pos -= fill;
+        fill = 0;
+      } else {
+        for (unsigned int c = 0; c < work_ch; c++) memmove(planar + c * capacity, planar + c * capacity + pos, (fill - pos) * sizeof(float));
+        fill -= pos;
+        pos = 0;
+      }
+      
+      const unsigned int count = min(capacity - fill, RESAMPLE_BLOCK_SIZE);
+      int r = hx_audio_decoder_read(d, block, count);
+      if (r < 0) break;
+      /* silence after the end of the stream */
+      memset(block + r * in_ch, 0, (count - r) * in_ch * sizeof(short));
+      
+      for (unsigned int c = 0; c < work_ch; c++) {
+        float *dst = planar + c * capacity + fill;
+        if (in_ch == work_ch) {
+          for (unsigned int s = 0; s < count; s++) dst[s] = block[s * in_ch + c];
+        } else {
+          const unsigned int sources = (in_ch - c + work_ch - 1) / work_ch;
+          const float scale = 1.0f / sources;
+          for (unsigned int s = 0; s < count; s++) {
+            float sum = 0.0f;
+            for (unsigned int j = c; j < in_ch; j += work_ch) sum += block[s * in_ch + j];
+            dst[s] = sum * scale;
+          }
+        }
+      }
+      fill += count;
+    }
+    if (pos + RESAMPLE_TAPS + 1 > fill) break;
+    
+    /* nearest phase if the ratio is finer than the filter table */
+    unsigned int phase = (unsigned int)((up == num_phases) ? frac : (frac * num_phases + up / 2) / up);
+    unsigned int first = pos;
+    if (phase == num_phases) {
+      phase = 0;
+      first++;
+    }
+    
+    const float *h = coefs + phase * RESAMPLE_TAPS;
+    for (unsigned int c = 0; c < work_ch; c++) {
+      float y = dot(planar + c * capacity + first, h);
+      y = (y > SHRT_MAX) ? SHRT_MAX : (y < SHRT_MIN) ? SHRT_MIN : y;
+      const signed short sample = (signed short)(y + ((y >= 0.0f) ? 0.5f : -0.5f));
+      for (unsigned int o = c; o < out_ch; o += work_ch) data[n * out_ch + o] = sample;
+    }
+    
+    frac += down;
+    pos += (unsigned int)(frac / up);
+    frac %= up;
+  }
+  
+  free(coefs);
+  hx_audio_decoder_free(&d);
+  if (n < num_out) {
+    free(data);
+    return -1;
+  }
+  
+  out->info.fmt = HX_AUDIO_FORMAT_PCM;
+  out->info.endianness = HX_NATIVE_ENDIAN;
+  out->info.num_channels = out_ch;
+  out->info.sample_rate = out_rate;
+  out->info.num_samples = num_out;
+  out->info.wavefile_cuuid = in->info.wavefile_cuuid;
+  out->data = data;
+  out->size = num_out * out_ch * sizeof(short);
+  return 0;
+}
+
+
+#pragma mark - Parallel decoding
+
+/** Select every kernel up front instead of from several threads at once. */
+static void audio_kernels_select(void) {
+  dsp_frame_decoder_select();
+  dsp_encode_evaluator_select();
+  psx_frame_decoder_select();
+  psx_encode_evaluator_select();
+  ima_block_decoder_select();
+  resample_dot_product_select();
+}
+
+/** Minimum number of frames decoded by a thread */
+#define AUDIO_PARALLEL_MIN_FRAMES 2048
+/** Number of frames decoded ahead of a chunk to estimate its initial history */
+#define AUDIO_PARALLEL_WARMUP_FRAMES 8
+
+struct audio_parallel_decode {
+  const HX_AudioStream *in;
+  /** Seek table of the input stream, if it was built */
+  const struct audio_seek_table *table;
+  signed short *out;
+  HX_Size num_frames;
+  HX_Size frames_per_chunk;
+  /** Initial history each chunk was decoded with, [chunk][channel][2] */
+  signed short *history;
+  int result;
+};
+
+/** Number of samples per channel in a frame */
+static unsigned int audio_decoder_frame_length(const HX_AudioDecoder *d, HX_Size frame) {
+  return min(d->samples_per_frame, d->info.num_samples - frame * d->samples_per_frame);
+}
+
+/** Record a failed chunk, chunks run concurrently */
+static void audio_parallel_decode_fail(struct audio_parallel_decode *p) {
+  __atomic_store_n(&p->result, -1, __ATOMIC_RELAXED);
+}
+
+static void audio_parallel_decode_chunk(unsigned int chunk, void* userdata) {
+  struct audio_parallel_decode *p = userdata;
+  HX_AudioDecoder *d = hx_audio_decoder_alloc(p->in);
+  if (!d) {
+    audio_parallel_decode_fail(p);
+    return;
+  }
+  
+  const unsigned int ch = d->info.num_channels;
+  const HX_Size first = chunk * p->frames_per_chunk;
+  const HX_Size last = min(first + p->frames_per_chunk, p->num_frames);
+  signed short *history = p->history + chunk * ch * 2;
+  
+  if (p->table) {
+    for (unsigned int c = 0; c < ch; c++) audio_decoder_set_history(d, c, p->table->history + (first * ch + c) * 2);
+  } else if (first > AUDIO_PARALLEL_WARMUP_FRAMES) {
+    /* guess the history by decoding the preceding frames from silence,
+     * the predictors usually converge to the exact state within a few frames */
+    const signed short zero[2] = { 0, 0 };
+    for (unsigned int c = 0; c < ch; c++) audio_decoder_set_history(d, c, zero);
+    for (d->frame = first - AUDIO_PARALLEL_WARMUP_FRAMES; d->frame < first; d->frame++) {
+      if (audio_decoder_decode(d, d->buffer, d->samples_per_frame) != 0) goto fail;
+    }
+  } else {
+    /* close enough to the start to decode from the initial state */
+    for (d->frame = 0; d->frame < first; d->frame++) {
+      if (audio_decoder_decode(d, d->buffer, d->samples_per_frame) != 0) goto fail;
+    }
+  }
+  
+  for (unsigned int c = 0; c < ch; c++) audio_decoder_get_history(d, c, history + c * 2);
+  for (d->frame = first; d->frame < last; d->frame++) {
+    signed short *dst = p->out + d->frame * d->samples_per_frame * ch;
+    if (audio_decoder_decode(d, dst, audio_decoder_frame_length(d, d->frame)) != 0) goto fail;
+  }
+  
+  hx_audio_decoder_free(&d);
+  return;
+fail:
+  audio_parallel_decode_fail(p);
+  hx_audio_decoder_free(&d);
+}
+
+/**
+ * Check that every chunk was decoded from the correct history, in order.
+ * A chunk that started from a wrong guess is decoded again from the real
+ * history until its output matches the original decode, which makes the
+ * rest of the chunk identical.
+ */
+static int audio_parallel_decode_verify(HX_AudioDecoder *d, struct audio_parallel_decode *p) {
+  const unsigned int ch = d->info.num_channels;
+  const HX_Size num_chunks = (p->num_frames + p->frames_per_chunk - 1) / p->frames_per_chunk;
+  
+  for (HX_Size chunk = 1; chunk < num_chunks; chunk++) {
+    const HX_Size first = chunk * p->frames_per_chunk;
+    const HX_Size last = min(first + p->frames_per_chunk, p->num_frames);
+    const signed short *end = p->out + first * d->samples_per_frame * ch;
+    
+    /* the history is the last two samples of the preceding frame */
+    int match = 1;
+    for (unsigned int c = 0; c < ch; c++) {
+      signed short history[2] = { *(end - ch + c), *(end - 2 * ch + c) };
+      audio_decoder_set_history(d, c, history);
+      match &= !memcmp(history, p->history + (chunk * ch + c) * 2, sizeof(history));
+    }
+    
+    for (d->frame = first; !match && d->frame < last; d->frame++) {
+      const unsigned int count = audio_decoder_frame_length(d, d->frame);
+      signed short *dst = p->out + d->frame * d->samples_per_frame * ch;
+      if (audio_decoder_decode(d, d->buffer, count) != 0) return -1;
+      
+      match = 1;
+      for (unsigned int c = 0; c < ch; c++) {
+        signed short history[2] = { 0, 0 };
+        audio_decoder_get_history(d, c, history);
+        match &= (history[0] == dst[(count - 1) * ch + c]) && (history[1] == dst[(count - 2) * ch + c]);
+      }
+      memcpy(dst, d->buffer, count * ch * sizeof(short));
+    }
+  }
+  
+  return 0;
+}
+
+static int audio_convert_parallel(const HX_AudioStream *in, HX_AudioStream *out, unsigned int num_threads) {
+  if (out->info.fmt != HX_AUDIO_FORMAT_PCM || (in->info.fmt != HX_AUDIO_FORMAT_DSP && in->info.fmt != HX_AUDIO_FORMAT_PSX)
+   || audio_resample_needed(&in->info, &out->info))
+    return hx_audio_convert(in, out);
+  
+  HX_AudioDecoder *d = hx_audio_decoder_alloc(in);
+  if (!d) return -1;
+  
+  struct audio_parallel_decode p = { .in = in, .num_frames = audio_decoder_num_frames(d), .result = 0 };
+  p.table = __atomic_load_n(&in->_seek_table, __ATOMIC_ACQUIRE);
+  if (num_threads == 0) num_threads = pool_num_threads();
+  
+  /* equally sized chunks */
+  p.frames_per_chunk = max((p.num_frames + num_threads - 1) / num_threads, AUDIO_PARALLEL_MIN_FRAMES);
+  const HX_Size num_chunks = (p.num_frames + p.frames_per_chunk - 1) / p.frames_per_chunk;
+  if (num_chunks <= 1 || d->samples_per_frame < 2) {
+    hx_audio_decoder_free(&d);
+    return audio_decode(in, out);
+  }
+  
+  if (audio_decoder_output_alloc(d, out) != 0 || !(p.history = malloc(num_chunks * d->info.num_channels * 2 * sizeof(short)))) {
+    hx_audio_decoder_free(&d);
+    return -1;
+  }
+  
+  p.out = out->data;
+  audio_kernels_select();
+  pool_for(num_threads, num_chunks, audio_parallel_decode_chunk, &p);
+  if (p.result == 0) p.result = audio_parallel_decode_verify(d, &p);
+  
+  free(p.history);
+  hx_audio_decoder_free(&d);
+  return p.result;
+}
+
+int hx_audio_convert_parallel(const HX_AudioStream *in, HX_AudioStream *out, unsigned int num_threads) {
+  return audio_stream_converted(out, audio_convert_parallel(in, out, num_threads), 0);
+}
+
+
+#pragma mark - Codec registry
+
+static HX_Size pcm_stream_pcm_size(const HX_AudioStream *s) {
+  return s->size;
+}
+
+static int pcm_convert_into(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode, void *buf, HX_Size cap) {
+  if (cap < in->size) return HX_AUDIO_BUFFER_TOO_SMALL;
+  memcpy(buf, in->data, in->size);
+  audio_stream_info_copy(&out->info, &in->info);
+  out->data = buf;
+  out->size = in->size;
+  return 0;
+}
+
+/* the input may be borrowed or mapped, so the output gets its own copy */
+static int pcm_convert(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode) {
+  return audio_encode_alloc(in, out, mode, in->size, pcm_convert_into);
+}
+
+static int pcm_decode(const HX_AudioStream *in, HX_AudioStream *out) {
+  return pcm_convert(in, out, HX_AUDIO_ENCODE_FAST);
+}
+
+static int pcm_decode_into(const HX_AudioStream *in, HX_AudioStream *out, void *buf, HX_Size cap) {
+  return pcm_convert_into(in, out, HX_AUDIO_ENCODE_FAST, buf, cap);
+}
+
+static HX_Size dsp_stream_pcm_size(const HX_AudioStream *s) {
+  /* the sample count is read from the header, which an unloaded external stream does not have yet */
+  if (s->data == NULL || s->size < sizeof(unsigned)) return 0;
+  return dsp_pcm_size(HX_BYTESWAP32(*(unsigned*)s->data)) * s->info.num_channels;
+}
+
+static HX_Size psx_stream_pcm_size(const HX_AudioStream *s) {
+  return psx_pcm_size(psx_sample_count(s->size, s->info.num_channels)) * s->info.num_channels;
+}
+
+static HX_Size ima_stream_pcm_size(const HX_AudioStream *s) {
+  return ima_sample_count(s->size, s->info.num_channels) * sizeof(short) * s->info.num_channels;
+}
+
+#define AUDIO_CODEC_MAX 16
+
+static HX_AudioCodec audio_codecs[AUDIO_CODEC_MAX] = {
+  {
+    .fmt = HX_AUDIO_FORMAT_PCM, .name = "PCM",
+    .samples_per_frame = 1, .bytes_per_frame = sizeof(short),
+    .decode = pcm_decode, .encode = pcm_convert, .pcm_size = pcm_stream_pcm_size,
+    .encoded_size = pcm_stream_pcm_size, .decode_into = pcm_decode_into, .encode_into = pcm_convert_into,
+  }, {
+    .fmt = HX_AUDIO_FORMAT_DSP, .name = "DSP ADPCM",
+    .samples_per_frame = DSP_SAMPLES_PER_FRAME, .bytes_per_frame = DSP_BYTES_PER_FRAME,
+    .simd = HX_AUDIO_CODEC_SSE2 | HX_AUDIO_CODEC_SSSE3 | HX_AUDIO_CODEC_AVX2,
+    .decode = audio_decode, .encode = dsp_encode, .pcm_size = dsp_stream_pcm_size,
+    .encoded_size = dsp_encoded_size, .decode_into = audio_decode_into, .encode_into = dsp_encode_into,
+    .encode_scratch_size = dsp_encode_scratch_size,
+  }, {
+    .fmt = HX_AUDIO_FORMAT_PSX, .name = "PSX ADPCM",
+    .samples_per_frame = PSX_SAMPLES_PER_FRAME, .bytes_per_frame = PSX_BYTES_PER_FRAME,
+    .simd = HX_AUDIO_CODEC_SSE2 | HX_AUDIO_CODEC_AVX2,
+    .decode = audio_decode, .encode = psx_encode, .pcm_size = psx_stream_pcm_size,
+    .encoded_size = psx_encoded_size, .decode_into = audio_decode_into, .encode_into = psx_encode_into,
+  }, {
+    .fmt = HX_AUDIO_FORMAT_IMA, .name = "IMA ADPCM",
+    .samples_per_frame = IMA_SAMPLES_PER_BLOCK, .bytes_per_frame = IMA_BYTES_PER_BLOCK,
+    .simd = HX_AUDIO_CODEC_AVX2,
+    .decode = audio_decode, .encode = ima_encode, .pcm_size = ima_stream_pcm_size,
+    .encoded_size = ima_encoded_size, .decode_into = audio_decode_into, .encode_into = ima_encode_into,
+  },
+};
+
+static unsigned int audio_num_codecs = 4;
+
+int hx_audio_codec_register(const HX_AudioCodec *codec) {
+  for (unsigned int i = 0; i < audio_num_codecs; i++) {
+    if (audio_codecs[i].fmt == codec->fmt) {
+      audio_codecs[i] = *codec;
+      return 0;
+    }
+  }
+  if (audio_num_codecs == AUDIO_CODEC_MAX) return -1;
+  audio_codecs[audio_num_codecs++] = *codec;
+  return 0;
+}
+
+const HX_AudioCodec *hx_audio_codec_find(enum HX_AudioFormat fmt) {
+  for (unsigned int i = 0; i < audio_num_codecs; i++)
+    if (audio_codecs[i].fmt == fmt) return &audio_codecs[i];
+  return NULL;
+}
+
+/**
+ * Resample while converting. Built-in formats are resampled as they are
+ * decoded, others are decoded first. An encoded output is encoded from
+ * the resampled PCM stream.
+ */
+static int audio_codec_convert_resampled(const HX_AudioCodec *decoder, const HX_AudioCodec *encoder, const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode) {
+  HX_AudioStream decoded, pcm;
+  size_t state_size;
+  hx_audio_stream_init(&decoded);
+  hx_audio_stream_init(&pcm);
+  audio_stream_info_copy(&pcm.info, &out->info);
+  
+  int result;
+  if (audio_decoder_state_size(in->info.fmt, &state_size) == 0) {
+    result = audio_resample(in, &pcm);
+  } else if (decoder->decode && (result = decoder->decode(in, &decoded)) == 0) {
+    result = audio_resample(&decoded, &pcm);
+    hx_audio_stream_dealloc(&decoded);
+  } else {
+    return -1;
+  }
+  
+  if (result != 0 || out->info.fmt == HX_AUDIO_FORMAT_PCM) {
+    if (result == 0) *out = pcm;
+    return result;
+  }
+  
+  result = encoder->encode ? encoder->encode(&pcm, out, mode) : -1;
+  hx_audio_stream_dealloc(&pcm);
+  return result;
+}
+
+/** Convert between any two formats, through PCM if neither of them is PCM. */
+static int audio_codec_convert(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode) {
+  const HX_AudioCodec *decoder = hx_audio_codec_find(in->info.fmt);
+  const HX_AudioCodec *encoder = hx_audio_codec_find(out->info.fmt);
+  if (!decoder || !encoder) return -1;
+  
+  if (audio_resample_needed(&in->info, &out->info)) return audio_codec_convert_resampled(decoder, encoder, in, out, mode);
+  
+  if (in->info.fmt == HX_AUDIO_FORMAT_PCM) return encoder->encode ? encoder->encode(in, out, mode) : -1;
+  if (!decoder->decode) return -1;
+  if (out->info.fmt == HX_AUDIO_FORMAT_PCM) return decoder->decode(in, out);
+  if (!encoder->encode) return -1;
+  
+  HX_AudioStream pcm;
+  hx_audio_stream_init(&pcm);
+  pcm.info.fmt = HX_AUDIO_FORMAT_PCM;
+  int result = decoder->decode(in, &pcm);
+  if (result == 0) result = encoder->encode(&pcm, out, mode);
+  hx_audio_stream_dealloc(&pcm);
+  return result;
+}
+
+/** Buffer size needed to encode a PCM stream with encode_into, or 0 if not supported. */
+static HX_Size audio_codec_encode_into_size(const HX_AudioCodec *encoder, const HX_AudioStream *pcm) {
+  if (!encoder->encode_into || !encoder->encoded_size) return 0;
+  return encoder->encoded_size(pcm) + (encoder->encode_scratch_size ? encoder->encode_scratch_size(pcm) : 0);
+}
+
+/**
+ * Upper bound of the PCM stream decoded from `in`, which is enough to size the
+ * encoder of a conversion between two encoded formats before decoding.
+ */
+static void audio_codec_pcm_bound(const HX_AudioCodec *decoder, const HX_AudioStream *in, HX_AudioStream *pcm) {
+  hx_audio_stream_init(pcm);
+  audio_stream_info_copy(&pcm->info, &in->info);
+  pcm->info.fmt = HX_AUDIO_FORMAT_PCM;
+  pcm->size = decoder->pcm_size ? decoder->pcm_size(in) : 0;
+  pcm->info.num_samples = in->info.num_channels ? pcm->size / sizeof(short) / in->info.num_channels : 0;
+}
+
+/**
+ * Size of the buffer needed by audio_codec_convert_into, or 0 if not supported.
+ * A conversion between two encoded formats keeps the intermediate PCM data past the encoder buffer.
+ */
+static HX_Size audio_codec_convert_size(const HX_AudioStream *in, const HX_AudioStream *out) {
+  const HX_AudioCodec *decoder = hx_audio_codec_find(in->info.fmt);
+  const HX_AudioCodec *encoder = hx_audio_codec_find(out->info.fmt);
+  if (!decoder || !encoder || audio_resample_needed(&in->info, &out->info)) return 0;
+  if (in->info.fmt == HX_AUDIO_FORMAT_PCM) return audio_codec_encode_into_size(encoder, in);
+  if (!decoder->decode_into || !decoder->pcm_size) return 0;
+  if (out->info.fmt == HX_AUDIO_FORMAT_PCM) return decoder->pcm_size(in);
+  
+  HX_AudioStream pcm;
+  audio_codec_pcm_bound(decoder, in, &pcm);
+  const HX_Size encode_size = audio_codec_encode_into_size(encoder, &pcm);
+  if (!encode_size || !pcm.size) return 0;
+  return (encode_size + 1) / 2 * 2 + pcm.size;
+}
+
+static int audio_codec_convert_into(const HX_AudioStream *in, HX_AudioStream *out, void *buf, HX_Size cap) {
+  const HX_AudioCodec *decoder = hx_audio_codec_find(in->info.fmt);
+  const HX_AudioCodec *encoder = hx_audio_codec_find(out->info.fmt);
+  if (!decoder || !encoder || audio_resample_needed(&in->info, &out->info)) return -1;
+  
+  if (in->info.fmt == HX_AUDIO_FORMAT_PCM)
+    return encoder->encode_into ? encoder->encode_into(in, out, HX_AUDIO_ENCODE_FAST, buf, cap) : -1;
+  if (!decoder->decode_into) return -1;
+  if (out->info.fmt == HX_AUDIO_FORMAT_PCM) return decoder->decode_into(in, out, buf, cap);
+  
+  /* decode past the encoder buffer, then encode from there into the front of `buf` */
+  const HX_Size size = audio_codec_convert_size(in, out);
+  if (!size) return -1;
+  if (cap < size) return HX_AUDIO_BUFFER_TOO_SMALL;
+  
+  HX_AudioStream pcm;
+  audio_codec_pcm_bound(decoder, in, &pcm);
+  const HX_Size encode_cap = size - pcm.size;
+  const int result = decoder->decode_into(in, &pcm, (char*)buf + encode_cap, cap - encode_cap);
+  if (result != 0) return result;
+  return encoder->encode_into(&pcm, out, HX_AUDIO_ENCODE_FAST, buf, encode_cap);
+}
+
+int hx_audio_codec_benchmark(enum HX_AudioFormat fmt, HX_Size num_samples, double *decode_rate, double *encode_rate) {
+  const HX_AudioCodec *codec = hx_audio_codec_find(fmt);
+  *decode_rate = *encode_rate = 0.0;
+  if (!codec || !num_samples) return -1;
+  if (codec->benchmark) return codec->benchmark(num_samples, decode_rate, encode_rate);
+  if (!codec->encode) return -1;
+  
+  HX_AudioStream pcm, encoded, decoded;
+  hx_audio_stream_init(&pcm);
+  hx_audio_stream_init(&encoded);
+  hx_audio_stream_init(&decoded);
+  
+  pcm.info.fmt = HX_AUDIO_FORMAT_PCM;
+  pcm.info.num_channels = 1;
+  pcm.info.sample_rate = 22050;
+  pcm.info.num_samples = num_samples;
+  pcm.size = num_samples * sizeof(short);
+  if (!(pcm.data = malloc(pcm.size))) return -1;
+  
+  /* a sweep with some noise, so that the predictors have work to do */
+  unsigned int seed = 1;
+  for (HX_Size s = 0; s < num_samples; s++) {
+    seed = seed * 1103515245 + 12345;
+    pcm.data[s] = (signed short)(12000.0 * sin(s * (0.01 + s * 1.0e-7)) + (int)((seed >> 16) & 0x3FF) - 512);
+  }
+  
+  encoded.info.fmt = fmt;
+  decoded.info.fmt = HX_AUDIO_FORMAT_PCM;
+  
+  clock_t start = clock();
+  int result = codec->encode(&pcm, &encoded, HX_AUDIO_ENCODE_FAST);
+  double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+  if (result == 0 && elapsed > 0.0) *encode_rate = num_samples / elapsed;
+  
+  if (result == 0 && codec->decode && fmt != HX_AUDIO_FORMAT_PCM) {
+    start = clock();
+    result = codec->decode(&encoded, &decoded);
+    elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (result == 0 && elapsed > 0.0) *decode_rate = num_samples / elapsed;
+    hx_audio_stream_dealloc(&decoded);
+  }
+  
+  if (fmt != HX_AUDIO_FORMAT_PCM) hx_audio_stream_dealloc(&encoded);
+  hx_audio_stream_dealloc(&pcm);
+  return result;
+}
+
+
+#pragma mark - Batch conversion
+
+struct audio_batch_item {
+  HX_Size cost;
+  HX_Size index;
+};
+
+struct audio_batch {
+  const HX_AudioStream **in;
+  HX_AudioStream **out;
+  enum HX_AudioEncodeMode mode;
+  struct audio_batch_item *items;
+  int *results;
+};
+
+static int audio_batch_compare(const void *a, const void *b) {
+  const struct audio_batch_item *ia = a, *ib = b;
+  if (ia->cost != ib->cost) return (ia->cost < ib->cost) ? 1 : -1;
+  /* keep the input order between equal streams */
+  return (ia->index < ib->index) ? -1 : 1;
+}
+
+static void audio_batch_convert(unsigned int index, void* userdata) {
+  struct audio_batch *b = userdata;
+  const HX_Size i = b->items[index].index;
+  const HX_AudioStream *in = b->in[i];
+  if (!in || (!in->data && in->size)) {
+    b->results[i] = -1;
+    return;
+  }
+  b->results[i] = (in->info.fmt == HX_AUDIO_FORMAT_PCM) ? hx_audio_encode(in, b->out[i], b->mode) : hx_audio_convert(in, b->out[i]);
+}
+
+int hx_audio_convert_batch(const HX_AudioStream **in, HX_AudioStream **out, HX_Size count, const HX_AudioBatchOptions *opts) {
+  const HX_AudioBatchOptions defaults = { 0, HX_AUDIO_ENCODE_FAST, NULL };
+  if (!opts) opts = &defaults;
+  if (count == 0) return 0;
+  
+  struct audio_batch b = { in, out, opts->mode };
+  b.items = malloc(count * sizeof(*b.items));
+  b.results = opts->results ? opts->results : malloc(count * sizeof(*b.results));
+  if (!b.items || !b.results) {
+    free(b.items);
+    if (b.results != opts->results) free(b.results);
+    return -1;
+  }
+  
+  /* estimate the work of each conversion by its decoded size,
+   * and start the largest first: the pool hands out indices in order */
+  for (HX_Size i = 0; i < count; i++) {
+    b.items[i].cost = in[i] ? max(hx_audio_stream_size(in[i]), in[i]->size) : 0;
+    b.items[i].index = i;
+  }
+  qsort(b.items, count, sizeof(*b.items), audio_batch_compare);
+  
+  audio_kernels_select();
+  unsigned int num_threads = opts->num_threads ? opts->num_threads : pool_num_threads();
+  pool_for(num_threads, count, audio_batch_convert, &b);
+  
+  int result = 0;
+  for (HX_Size i = 0; i < count; i++) if (b.results[i] != 0) result = -1;
+  
+  free(b.items);
+  if (b.results != opts->results) free(b.results);
+  return result;
+}
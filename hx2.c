@@ -6,12 +6,16 @@
  *****************************************************************/
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "hx2.h"
 #include "stream.h"
 #include "waveformat.h"
+#include "pool.h"
+#include "arena.h"
 
 #include "codec.c"
 
@@ -26,7 +30,25 @@ struct HX_Context {
   HX_ReadCallback read_cb;
   HX_WriteCallback write_cb;
   HX_ErrorCallback error_cb;
+  HX_ReleaseCallback release_cb;
+  HX_RemoveCallback remove_cb;
   void* userdata;
+  unsigned int flags;
+  
+  /* file data returned by the read callback, kept until the context is freed */
+  struct hx_file_data {
+    char* data;
+    size_t size;
+  } *files;
+  unsigned int num_files;
+  
+  /* parse-time metadata of all read entries */
+  struct arena arena;
+  
+  /* open-addressing cuuid hash of the first `index_size` entries, slots hold entry index + 1 */
+  unsigned int *index_slots;
+  unsigned int index_capacity;
+  unsigned int index_size;
 };
 
 #define strlen(s) (HX_Size)strlen(s)
@@ -42,13 +64,49 @@ void hx_audio_stream_init(HX_AudioStream *s) {
   s->info.wavefile_cuuid = 0;
   s->size = 0;
   s->data = NULL;
+  s->_seek_table = NULL;
+  s->_release = NULL;
+  s->_release_userdata = NULL;
+  s->_borrowed = 0;
 }
 
 void hx_audio_stream_dealloc(HX_AudioStream *s) {
-  free(s->data);
+  if (s->_borrowed) {
+    /* the data belongs to someone else */
+  } else if (s->_release) {
+    s->_release(s->data, s->size, s->_release_userdata);
+  } else {
+    free(s->data);
+  }
+  free(s->_seek_table);
+}
+
+int hx_audio_stream_borrowed(const HX_AudioStream *s) {
+  return s->_borrowed;
 }
 
+int hx_audio_stream_make_writable(HX_AudioStream *s) {
+  if (!s->_borrowed && !s->_release) return 0;
+  
+  signed short *data = malloc(s->size);
+  if (!data) return -1;
+  memcpy(data, s->data, s->size);
+  if (!s->_borrowed) s->_release(s->data, s->size, s->_release_userdata);
+  
+  s->data = data;
+  s->_borrowed = 0;
+  s->_release = NULL;
+  s->_release_userdata = NULL;
+  return 0;
+}
+
+/** Size of the chunks written by hx_audio_stream_write_wav */
+#define WAV_WRITE_CHUNK_SIZE 0x10000
+
 int hx_audio_stream_write_wav(const HX_Context *hx, HX_AudioStream *s, const char* filename) {
+  /* the chunks are split by the block alignment, which is 0 without channels */
+  if (s->info.num_channels == 0) return -1;
+  const int decode = s->info.fmt != HX_AUDIO_FORMAT_PCM;
   struct waveformat_header header;
   waveformat_default_header(&header);
   header.sample_rate = s->info.sample_rate;
@@ -57,33 +115,73 @@ int hx_audio_stream_write_wav(const HX_Context *hx, HX_AudioStream *s, const cha
   header.bytes_per_second = s->info.num_channels * s->info.sample_rate * header.bits_per_sample / 8;
   header.block_alignment = header.num_channels * header.bits_per_sample / 8;
   header.subchunk2_size = s->size;
-
-  stream_t wave_stream = stream_alloc(s->size + sizeof(header), STREAM_MODE_WRITE, HX_LITTLE_ENDIAN);
-  waveformat_rw(&wave_stream, &header, s->data);
-  size_t sz = wave_stream.size;
-  hx->write_cb(filename, wave_stream.buf, 0, &sz, hx->userdata);
+  
+  HX_AudioDecoder *d = NULL;
+  if (decode) {
+    if (!(d = hx_audio_decoder_alloc(s))) return -1;
+    header.subchunk2_size = hx_audio_decoder_info(d)->num_samples * header.block_alignment;
+  }
+  header.riff_length = header.subchunk2_size + sizeof(header) - 8;
+  
+  stream_t wave_stream = stream_alloc(sizeof(header), STREAM_MODE_WRITE, HX_LITTLE_ENDIAN);
+  if (!wave_stream.buf) {
+    if (d) hx_audio_decoder_free(&d);
+    return -1;
+  }
+  waveformat_header_rw(&wave_stream, &header);
+  size_t pos = wave_stream.size;
+  hx->write_cb(filename, wave_stream.buf, 0, &pos, hx->userdata);
+  
+  /* the data is written in fixed-size chunks, decoding each one on the way */
+  int result = (pos == wave_stream.size) ? 0 : -1;
   stream_dealloc(&wave_stream);
+  signed short *chunk = decode ? malloc(WAV_WRITE_CHUNK_SIZE) : NULL;
+  if (decode && !chunk) result = -1;
   
-  return 0;
+  for (HX_Size offset = 0; result == 0 && offset < header.subchunk2_size;) {
+    size_t sz = min(WAV_WRITE_CHUNK_SIZE, header.subchunk2_size - offset);
+    void *data = (char*)s->data + offset;
+    if (decode) {
+      const int n = hx_audio_decoder_read(d, chunk, WAV_WRITE_CHUNK_SIZE / header.block_alignment);
+      if (n <= 0) {
+        result = -1;
+        break;
+      }
+      sz = n * header.block_alignment;
+      data = chunk;
+    }
+    size_t written = sz;
+    hx->write_cb(filename, data, pos, &written, hx->userdata);
+    if (written != sz) result = -1;
+    offset += sz;
+    pos += sz;
+  }
+  
+  free(chunk);
+  if (d) hx_audio_decoder_free(&d);
+  return result;
 }
 
 HX_Size hx_audio_stream_size(const HX_AudioStream *s) {
-  switch (s->info.fmt) {
-    case HX_AUDIO_FORMAT_PCM:
-      return s->size;
-    case HX_AUDIO_FORMAT_DSP:
-      return dsp_pcm_size(HX_BYTESWAP32(*(unsigned*)s->data));
-    default:
-      return 0;
-  }
+  const HX_AudioCodec *codec = hx_audio_codec_find(s->info.fmt);
+  return (codec && codec->pcm_size) ? codec->pcm_size(s) : 0;
 }
 
 int hx_audio_convert(const HX_AudioStream *in, HX_AudioStream *out) {
-  if (in->info.fmt == HX_AUDIO_FORMAT_PCM && out->info.fmt == HX_AUDIO_FORMAT_PCM) { *out = *in; return 0; };
-  if (in->info.fmt == HX_AUDIO_FORMAT_DSP && out->info.fmt == HX_AUDIO_FORMAT_PCM) return dsp_decode(in, out);
-  if (in->info.fmt == HX_AUDIO_FORMAT_PSX && out->info.fmt == HX_AUDIO_FORMAT_PCM) return psx_decode(in, out);
-  if (in->info.fmt == HX_AUDIO_FORMAT_PCM && out->info.fmt == HX_AUDIO_FORMAT_DSP) return dsp_encode(in, out);
-  return -1;
+  return audio_stream_converted(out, audio_codec_convert(in, out, HX_AUDIO_ENCODE_FAST), 0);
+}
+
+HX_Size hx_audio_convert_size(const HX_AudioStream *in, const HX_AudioStream *out) {
+  return audio_codec_convert_size(in, out);
+}
+
+int hx_audio_convert_into(const HX_AudioStream *in, HX_AudioStream *out, void *buf, size_t cap) {
+  return audio_stream_converted(out, audio_codec_convert_into(in, out, buf, (cap > UINT_MAX) ? UINT_MAX : (HX_Size)cap), 1);
+}
+
+int hx_audio_encode(const HX_AudioStream *in, HX_AudioStream *out, enum HX_AudioEncodeMode mode) {
+  if (in->info.fmt != HX_AUDIO_FORMAT_PCM) return -1;
+  return audio_stream_converted(out, audio_codec_convert(in, out, mode), 0);
 }
 
 #pragma mark -
@@ -93,6 +191,8 @@ static struct hx_class_table_entry {
   int crossversion;
   int (*rw)(HX_Context*, HX_Entry*);
   void (*dealloc)(HX_Entry*);
+  /* release what is not allocated from the context arena */
+  void (*release)(HX_Entry*);
 } const hx_class_table[];
 
 static struct hx_version_table_entry {
@@ -127,15 +227,23 @@ static enum HX_Class hx_class_from_string(const char* name) {
 
 #pragma mark - Context
 
+/* entries are read on several threads */
+static pthread_mutex_t hx_error_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int hx_error(const HX_Context *hx, const char* format, ...) {
-  va_list args;
+  va_list args, copy;
   va_start(args, format);
+  /* the arguments are formatted twice */
+  va_copy(copy, args);
+  pthread_mutex_lock(&hx_error_lock);
   printf("[libhx] ");
   vfprintf(stderr, format, args);
   char buf[4096];
-  vsnprintf(buf, 4096, format, args);
+  vsnprintf(buf, 4096, format, copy);
+  va_end(copy);
   hx->error_cb(buf, hx->userdata);
   printf("\n");
+  pthread_mutex_unlock(&hx_error_lock);
   va_end(args);
   return -1;
 }
@@ -201,7 +309,52 @@ HX_Entry* hx_context_get_entry(const HX_Context *hx, unsigned int index) {
   return (index < hx->num_entries) ? &hx->entries[index] : NULL;
 }
 
+static unsigned int hx_index_hash(HX_CUUID cuuid, unsigned int capacity) {
+  cuuid ^= cuuid >> 33;
+  cuuid *= 0xFF51AFD7ED558CCDull;
+  cuuid ^= cuuid >> 33;
+  return (unsigned int)cuuid & (capacity - 1);
+}
+
+/** Add the entry at `index` to the hash, keeping the first of duplicate cuuids. */
+static void hx_index_insert(HX_Context *hx, unsigned int index) {
+  const HX_CUUID cuuid = hx->entries[index].i_cuuid;
+  unsigned int slot = hx_index_hash(cuuid, hx->index_capacity);
+  while (hx->index_slots[slot]) {
+    if (hx->entries[hx->index_slots[slot] - 1].i_cuuid == cuuid) return;
+    slot = (slot + 1) & (hx->index_capacity - 1);
+  }
+  hx->index_slots[slot] = index + 1;
+}
+
+/** Hash the entries added since the last update, growing the table to keep the load below one half. */
+static int hx_index_update(HX_Context *hx) {
+  if (hx->num_entries * 2 > hx->index_capacity) {
+    unsigned int capacity = 64;
+    while (capacity < hx->num_entries * 2) capacity *= 2;
+    unsigned int *slots = calloc(capacity, sizeof(*slots));
+    if (!slots) return -1;
+    free(hx->index_slots);
+    hx->index_slots = slots;
+    hx->index_capacity = capacity;
+    hx->index_size = 0;
+  }
+  
+  for (; hx->index_size < hx->num_entries; hx->index_size++) hx_index_insert(hx, hx->index_size);
+  return 0;
+}
+
 HX_Entry *hx_context_find_entry(const HX_Context *hx, HX_CUUID cuuid) {
+  if (hx->index_size == hx->num_entries && hx->index_slots) {
+    unsigned int slot = hx_index_hash(cuuid, hx->index_capacity);
+    for (; hx->index_slots[slot]; slot = (slot + 1) & (hx->index_capacity - 1)) {
+      HX_Entry *e = &hx->entries[hx->index_slots[slot] - 1];
+      if (e->i_cuuid == cuuid) return e;
+    }
+    return NULL;
+  }
+  
+  /* entries were added without updating the hash */
   for (unsigned int i = 0; i < hx->num_entries; i++)
     if (hx->entries[i].i_cuuid == cuuid) return &hx->entries[i];
   return NULL;
@@ -209,8 +362,13 @@ HX_Entry *hx_context_find_entry(const HX_Context *hx, HX_CUUID cuuid) {
 
 #pragma mark - Class -
 
+/** Allocate parse-time metadata, released with the context */
+static void* hx_alloc(HX_Context *hx, size_t size) {
+  return arena_alloc(&hx->arena, size);
+}
+
 #define hx_entry_data() \
-  (entry->p_data = (hx->stream.mode == STREAM_MODE_WRITE ? entry->p_data : malloc(sizeof(*data))))
+  (entry->p_data = (hx->stream.mode == STREAM_MODE_WRITE ? entry->p_data : hx_alloc(hx, sizeof(*data))))
 
 static int EventResData(HX_Context *hx, HX_Entry *entry) {
   HX_EventResData *data = hx_entry_data();
@@ -267,7 +425,7 @@ static int WavResData(HX_Context *hx, HX_Entry *entry) {
   if (data->res_data.flags & HX_WAVRES_OBJ_FLAG_MULTIPLE) {    
     stream_rw32(&hx->stream, &data->num_links);
     if (hx->stream.mode == STREAM_MODE_READ) {
-      data->links = malloc(sizeof(*data->links) * data->num_links);
+      data->links = hx_alloc(hx, sizeof(*data->links) * data->num_links);
     }
   }
   
@@ -296,7 +454,7 @@ static int SwitchResData(HX_Context *hx, HX_Entry *entry) {
   stream_rw32(&hx->stream, &data->num_links);
   
   if (hx->stream.mode == STREAM_MODE_READ) {
-    data->links = malloc(sizeof(HX_SwitchResData) * data->num_links);
+    data->links = hx_alloc(hx, sizeof(*data->links) * data->num_links);
   }
   
   for (unsigned int i = 0; i < data->num_links; i++) {
@@ -321,7 +479,7 @@ static int RandomResData(HX_Context *hx, HX_Entry *entry) {
   stream_rw32(&hx->stream, &data->num_links);
   
   if (hx->stream.mode == STREAM_MODE_READ) {
-    data->links = malloc(sizeof(*data->links) * data->num_links);
+    data->links = hx_alloc(hx, sizeof(*data->links) * data->num_links);
   }
   
   for (unsigned i = 0; i < data->num_links; i++) {
@@ -349,7 +507,7 @@ static int ProgramResData(HX_Context *hx, HX_Entry *entry) {
   
   if (s->mode == STREAM_MODE_READ) {
     entry->_tmp_file_size = entry->_file_size - (4 + length + 8);
-    data->data = malloc(entry->_file_size);
+    data->data = hx_alloc(hx, entry->_file_size);
   }
   
   /* just copy the entire internal entry (minus the header) */
@@ -402,29 +560,87 @@ static void IdObjPtrRW(HX_Context *hx, HX_IdObjPtr *data) {
   }
 }
 
+/** Read the data of an external stream */
+static int WaveFileIdObj_LoadExternal(const HX_Context *hx, HX_WaveFileIdObj *data) {
+  size_t sz = data->ext_stream_size;
+  if (!(data->audio_stream->data = (short*)hx->read_cb(data->ext_stream_filename, data->ext_stream_offset, &sz, hx->userdata))) {
+    return hx_error(hx, "failed to read from external stream (%s @ 0x%X)", data->ext_stream_filename, data->ext_stream_offset);
+  }
+  /* the read callback may return less than requested */
+  if (sz < data->audio_stream->size) data->audio_stream->size = sz;
+  data->audio_stream->_release = hx->release_cb;
+  data->audio_stream->_release_userdata = hx->userdata;
+  data->_ext_stream_pending = 0;
+  return 0;
+}
+
+/**
+ * Update the format fields of a wave header from the frame geometry of the stream codec.
+ * The header is left as read unless the format, channel count or sample rate changed.
+ */
+static void WaveFileIdObj_UpdateFormat(struct waveformat_header *header, const HX_AudioStream *s) {
+  if (header->format == s->info.fmt && header->num_channels == s->info.num_channels && header->sample_rate == s->info.sample_rate) return;
+  header->format = s->info.fmt;
+  header->num_channels = s->info.num_channels;
+  header->sample_rate = s->info.sample_rate;
+  
+  const HX_AudioCodec *codec = hx_audio_codec_find(s->info.fmt);
+  if (!codec || codec->samples_per_frame == 0) return;
+  header->bits_per_sample = codec->bytes_per_frame * 8 / codec->samples_per_frame;
+  header->block_alignment = codec->bytes_per_frame * s->info.num_channels;
+  header->bytes_per_second = (unsigned int)((unsigned long long)s->info.sample_rate * header->block_alignment / codec->samples_per_frame);
+}
+
 static int WaveFileIdObj(HX_Context *hx, HX_Entry *entry) {
   HX_WaveFileIdObj *data = hx_entry_data();
+  if (hx->stream.mode == STREAM_MODE_READ) {
+    data->_ext_stream_pending = 0;
+  } else if (data->_ext_stream_pending) {
+    /* deferred external data is needed to write it back */
+    if (WaveFileIdObj_LoadExternal(hx, data) != 0) return -1;
+  }
   IdObjPtrRW(hx, &data->id_obj);
   
   if (data->id_obj.flags & HX_ID_OBJ_PTR_FLAG_EXTERNAL) {
-    if (hx->version == HX_VERSION_HX2) {
-      memmove(data->ext_stream_filename + 2, data->ext_stream_filename, strlen(data->ext_stream_filename)+1);
-      memcpy(data->ext_stream_filename, ".\\", 2);
+    /* hx2 filenames are relative to the current directory. The prefix is added to a copy,
+     * as every write pass serializes the entry */
+    char filename[HX_STRING_MAX_LENGTH + 2] = { 0 };
+    if (hx->stream.mode == STREAM_MODE_WRITE) {
+      snprintf(filename, sizeof filename, "%s%s", (hx->version == HX_VERSION_HX2) ? ".\\" : "", data->ext_stream_filename);
     }
-    unsigned int name_length = strlen(data->ext_stream_filename);
+    unsigned int name_length = strlen(filename);
     stream_rw32(&hx->stream, &name_length);
-    stream_rw(&hx->stream, data->ext_stream_filename, name_length);
+    if (name_length >= HX_STRING_MAX_LENGTH) return hx_error(hx, "external stream filename too long");
+    stream_rw(&hx->stream, filename, name_length);
+    if (hx->stream.mode == STREAM_MODE_READ) {
+      /* Make sure the filename is correctly formatted */
+      const unsigned int prefix = strncmp(filename, ".\\", 2) ? 0 : 2;
+      memcpy(data->ext_stream_filename, filename + prefix, name_length - prefix);
+      data->ext_stream_filename[name_length - prefix] = '\0';
+    }
   } else {
     data->ext_stream_offset = 0;
     data->ext_stream_size = 0;
   }
   
-  if (hx->stream.mode == STREAM_MODE_READ) data->_wave_header = malloc(sizeof(struct waveformat_header));
+  if (hx->stream.mode == STREAM_MODE_READ) data->_wave_header = hx_alloc(hx, sizeof(struct waveformat_header));
+  if (hx->stream.mode == STREAM_MODE_WRITE) {
+    /* the stream may have been converted since it was read */
+    struct waveformat_header* wave_header = data->_wave_header;
+    WaveFileIdObj_UpdateFormat(wave_header, data->audio_stream);
+    if (data->id_obj.flags & HX_ID_OBJ_PTR_FLAG_EXTERNAL) {
+      data->ext_stream_size = data->audio_stream->size;
+    } else {
+      wave_header->riff_length += data->audio_stream->size - wave_header->subchunk2_size;
+      wave_header->subchunk2_size = data->audio_stream->size;
+    }
+  }
+  
   if (!waveformat_header_rw(&hx->stream, data->_wave_header)) {
     return hx_error(hx, "failed to read wave format header");
   }
   
-  HX_AudioStream *audio_stream = (hx->stream.mode == STREAM_MODE_READ) ? malloc(sizeof(*audio_stream)) : data->audio_stream;
+  HX_AudioStream *audio_stream = (hx->stream.mode == STREAM_MODE_READ) ? hx_alloc(hx, sizeof(*audio_stream)) : data->audio_stream;
   if (hx->stream.mode == STREAM_MODE_READ) {
     struct waveformat_header* wave_header = data->_wave_header;
     audio_stream->info.fmt = wave_header->format;
@@ -432,6 +648,10 @@ static int WaveFileIdObj(HX_Context *hx, HX_Entry *entry) {
     audio_stream->info.endianness = hx->stream.endianness;
     audio_stream->info.sample_rate = wave_header->sample_rate;
     audio_stream->size = wave_header->subchunk2_size;
+    audio_stream->_seek_table = NULL;
+    audio_stream->_release = NULL;
+    audio_stream->_release_userdata = NULL;
+    audio_stream->_borrowed = 0;
   }
   
   data->audio_stream = audio_stream;
@@ -449,27 +669,26 @@ static int WaveFileIdObj(HX_Context *hx, HX_Entry *entry) {
     
     if (hx->stream.mode == STREAM_MODE_READ) {
       audio_stream->size = data->ext_stream_size;
-      /* Make sure the filename is correctly formatted */
-      if (!strncmp(data->ext_stream_filename, ".\\", 2)) {
-        snprintf(data->ext_stream_filename, sizeof data->ext_stream_filename, "%s", data->ext_stream_filename + 2);
-      }
-        
-      size_t sz = data->ext_stream_size;
-      if (!(audio_stream->data = (short*)hx->read_cb(data->ext_stream_filename, data->ext_stream_offset, &sz, hx->userdata))) {
-        return hx_error(hx, "failed to read from external stream (%s @ 0x%X)", data->ext_stream_filename, data->ext_stream_offset);
-      }
-    } else if (hx->stream.mode == STREAM_MODE_WRITE) {
-      
-      size_t sz = data->ext_stream_size;
-      hx->write_cb(data->ext_stream_filename, data->audio_stream->data, data->ext_stream_offset, &sz, hx->userdata);
+      audio_stream->data = NULL;
+      data->_ext_stream_pending = 1;
+      /* lazy external streams are read on first access */
+      if (!(hx->flags & HX_OPEN_FLAG_LAZY_EXTERNAL) && WaveFileIdObj_LoadExternal(hx, data) != 0) return -1;
     }
+    /* external data is written by hx_write_external_streams once the .hx file is complete */
   } else {
     struct waveformat_header* wave_header = data->_wave_header;
     /* data code must be "data" */
     assert(wave_header->subchunk2_id == 0x61746164);
-    /* read internal stream data */
-    audio_stream->data = (hx->stream.mode == STREAM_MODE_READ) ? malloc(wave_header->subchunk2_size) : audio_stream->data;
-    stream_rw(&hx->stream, audio_stream->data, wave_header->subchunk2_size);
+    if (hx->stream.mode == STREAM_MODE_READ && (hx->flags & HX_OPEN_FLAG_BORROW_INTERNAL)) {
+      /* point into the file data instead of copying */
+      audio_stream->data = (short*)(hx->stream.buf + hx->stream.pos);
+      audio_stream->_borrowed = 1;
+      stream_advance(&hx->stream, wave_header->subchunk2_size);
+    } else {
+      /* read internal stream data */
+      audio_stream->data = (hx->stream.mode == STREAM_MODE_READ) ? malloc(wave_header->subchunk2_size) : audio_stream->data;
+      stream_rw(&hx->stream, audio_stream->data, wave_header->subchunk2_size);
+    }
   }
   
   if (hx->stream.mode == STREAM_MODE_READ) {
@@ -484,7 +703,7 @@ static int WaveFileIdObj(HX_Context *hx, HX_Entry *entry) {
     if (data->_extra_wave_data_length > 0) {
       if (!(data->id_obj.flags & HX_ID_OBJ_PTR_FLAG_EXTERNAL)) data->_extra_wave_data_length += 1;
       
-      data->_extra_wave_data = malloc(data->_extra_wave_data_length);
+      data->_extra_wave_data = hx_alloc(hx, data->_extra_wave_data_length);
       memcpy(data->_extra_wave_data, hx->stream.buf + hx->stream.pos, data->_extra_wave_data_length);
       stream_advance(&hx->stream, data->_extra_wave_data_length);
     }
@@ -501,6 +720,11 @@ static int WaveFileIdObj(HX_Context *hx, HX_Entry *entry) {
   return 0;
 }
 
+static void WaveFileIdObj_Release(HX_Entry *entry) {
+  HX_WaveFileIdObj *data = entry->p_data;
+  hx_audio_stream_dealloc(data->audio_stream);
+}
+
 static void WaveFileIdObj_Free(HX_Entry *entry) {
   HX_WaveFileIdObj *data = entry->p_data;
   hx_audio_stream_dealloc(data->audio_stream);
@@ -511,14 +735,33 @@ static void WaveFileIdObj_Free(HX_Entry *entry) {
 }
 
 static const struct hx_class_table_entry hx_class_table[] = {
-  [HX_CLASS_EVENT_RESOURCE_DATA] = {"EventResData", 1, EventResData, EventResData_Free},
-  [HX_CLASS_WAVE_RESOURCE_DATA] = {"WavResData", 0, WavResData, WavResData_Free},
-  [HX_CLASS_SWITCH_RESOURCE_DATA] = {"SwitchResData", 1, SwitchResData, SwitchResData_Free},
-  [HX_CLASS_RANDOM_RESOURCE_DATA] = {"RandomResData", 1, RandomResData, RandomResData_Free},
-  [HX_CLASS_PROGRAM_RESOURCE_DATA] = {"ProgramResData", 1, ProgramResData, ProgramResData_Free},
-  [HX_CLASS_WAVE_FILE_ID_OBJECT] = {"WaveFileIdObj", 0, WaveFileIdObj, WaveFileIdObj_Free},
+  [HX_CLASS_EVENT_RESOURCE_DATA] = {"EventResData", 1, EventResData, EventResData_Free, NULL},
+  [HX_CLASS_WAVE_RESOURCE_DATA] = {"WavResData", 0, WavResData, WavResData_Free, NULL},
+  [HX_CLASS_SWITCH_RESOURCE_DATA] = {"SwitchResData", 1, SwitchResData, SwitchResData_Free, NULL},
+  [HX_CLASS_RANDOM_RESOURCE_DATA] = {"RandomResData", 1, RandomResData, RandomResData_Free, NULL},
+  [HX_CLASS_PROGRAM_RESOURCE_DATA] = {"ProgramResData", 1, ProgramResData, ProgramResData_Free, NULL},
+  [HX_CLASS_WAVE_FILE_ID_OBJECT] = {"WaveFileIdObj", 0, WaveFileIdObj, WaveFileIdObj_Free, WaveFileIdObj_Release},
 };
 
+HX_AudioStream *hx_context_audio_stream(const HX_Context *hx, HX_WaveFileIdObj *data) {
+  if (data->_ext_stream_pending && WaveFileIdObj_LoadExternal(hx, data) != 0) return NULL;
+  return data->audio_stream;
+}
+
+int hx_context_convert_batch(const HX_Context *hx, HX_WaveFileIdObj **objs, HX_AudioStream **out, HX_Size count, const HX_AudioBatchOptions *opts) {
+  const HX_AudioStream **in = malloc(max(count, 1) * sizeof(*in));
+  if (!in) return -1;
+  
+  /* read pending external streams here rather than from the pool threads */
+  int result = 0;
+  for (HX_Size i = 0; i < count; i++)
+    if (!(in[i] = hx_context_audio_stream(hx, objs[i]))) result = -1;
+  
+  if (hx_audio_convert_batch(in, out, count, opts) != 0) result = -1;
+  free(in);
+  return result;
+}
+
 #pragma mark - Entry
 
 void hx_entry_init(HX_Entry *e) {
@@ -526,14 +769,21 @@ void hx_entry_init(HX_Entry *e) {
   e->i_class = HX_CLASS_INVALID;
   e->num_links = 0;
   e->num_languages = 0;
+  e->links = NULL;
   e->language_links = NULL;
   e->_file_offset = 0;
   e->_file_size = 0;
   e->_tmp_file_size = 0;
   e->p_data = NULL;
+  e->_arena = 0;
 }
 
 void hx_entry_dealloc(HX_Entry *e) {
+  if (e->_arena) {
+    /* the metadata is freed with the context */
+    if (e->i_class != HX_CLASS_INVALID && hx_class_table[e->i_class].release) hx_class_table[e->i_class].release(e);
+    return;
+  }
   if (e->links) free(e->links);
   if (e->language_links) free(e->language_links);
   if (e->i_class != HX_CLASS_INVALID) hx_class_table[e->i_class].dealloc(e);
@@ -582,8 +832,9 @@ static void PostRead(HX_Context *hx) {
     for (unsigned int i = 0; i < hx->num_entries; i++) {
       if (hx->entries[i].i_class == HX_CLASS_EVENT_RESOURCE_DATA) {
         HX_EventResData *data = hx->entries[i].p_data;
+        if (!data) continue;
         HX_Entry *entry = hx_context_find_entry(hx, data->link);
-        if (entry->i_class == HX_CLASS_WAVE_RESOURCE_DATA) {
+        if (entry && entry->p_data && entry->i_class == HX_CLASS_WAVE_RESOURCE_DATA) {
           HX_WavResData *wavresdata = entry->p_data;
           strncpy(wavresdata->res_data.name, data->name, HX_STRING_MAX_LENGTH);
         }
@@ -594,18 +845,150 @@ static void PostRead(HX_Context *hx) {
   for (unsigned int i = 0; i < hx->num_entries; i++) {
     if (hx->entries[i].i_class == HX_CLASS_WAVE_RESOURCE_DATA) {
       HX_WavResData *data = hx->entries[i].p_data;
-      for (unsigned int l = 0; l < data->num_links; l++) {
-        HX_WaveFileIdObj *obj = hx_context_find_entry(hx, data->links[l].cuuid)->p_data;
+      for (unsigned int l = 0; data && l < data->num_links; l++) {
+        HX_Entry *entry = hx_context_find_entry(hx, data->links[l].cuuid);
+        if (!entry || !entry->p_data || entry->i_class != HX_CLASS_WAVE_FILE_ID_OBJECT) continue;
+        HX_WaveFileIdObj *obj = entry->p_data;
         
+        /* shorten the resource name so that the language suffix always fits */
+        const char* language = hx_language_name(data->links[l].language);
+        const int name_length = HX_STRING_MAX_LENGTH - 2 - (int)strlen(language);
         char buf[HX_STRING_MAX_LENGTH];
         memset(buf, 0, HX_STRING_MAX_LENGTH);
-        snprintf(buf, HX_STRING_MAX_LENGTH, "%s_%s", data->res_data.name, hx_language_name(data->links[l].language));
+        snprintf(buf, HX_STRING_MAX_LENGTH, "%.*s_%s", name_length, data->res_data.name, language);
         memcpy(obj->name, buf, HX_STRING_MAX_LENGTH);
       }
     }
   }
 }
 
+/** Read or write the index record of an entry */
+static void hx_index_entry_rw(HX_Context *hx, stream_t *s, HX_Entry *entry, unsigned int index_type) {
+  HX_Size classname_length = 0;
+  
+  char classname[HX_STRING_MAX_LENGTH];
+  if (s->mode == STREAM_MODE_WRITE) {
+    classname_length = hx_class_name(entry->i_class, hx->version, classname, HX_STRING_MAX_LENGTH);
+  }
+  
+  stream_rw32(s, &classname_length);
+  stream_rw(s, classname, classname_length);
+  
+  if (s->mode == STREAM_MODE_READ) {
+    hx_entry_init(entry);
+    entry->i_class = hx_class_from_string(classname);
+    entry->_arena = 1;
+  }
+  
+  unsigned int zero = 0;
+  stream_rwcuuid(s, &entry->i_cuuid);
+  stream_rw32(s, &entry->_file_offset);
+  stream_rw32(s, &entry->_file_size);
+  stream_rw32(s, &zero);
+  stream_rw32(s, &entry->num_links);
+  
+  assert(zero == 0);
+  
+  if (index_type == 0x2) {
+    if (s->mode == STREAM_MODE_READ) {
+      entry->links = hx_alloc(hx, sizeof(*entry->links) * entry->num_links);
+    }
+
+    for (int i = 0; i < entry->num_links; i++) {
+      stream_rwcuuid(s, entry->links + i);
+    }
+
+    stream_rw32(s, &entry->num_languages);
+    if (s->mode == STREAM_MODE_READ) {
+      entry->language_links = hx_alloc(hx, sizeof(*entry->language_links) * entry->num_languages);
+    }
+
+    for (int i = 0; i < entry->num_languages; i++) {
+      unsigned int language_code = hx_language_to_code(entry->language_links[i].language);
+      stream_rw32(s, &language_code);
+      stream_rw32(s, &entry->language_links[i].unknown);
+      stream_rwcuuid(s, &entry->language_links[i].cuuid);
+      if (s->mode == STREAM_MODE_READ)
+        entry->language_links[i].language = hx_language_from_code(language_code);
+    }
+  }
+}
+
+/* entries per batch of the parallel read, at least */
+#define HX_READ_BATCH_MIN_ENTRIES 64
+
+struct hx_read_work {
+  const HX_Context *hx;
+  unsigned int first, count;
+  unsigned int batch_size;
+  struct arena *arenas;
+};
+
+static void hx_read_batch(unsigned int index, void* userdata) {
+  struct hx_read_work *work = userdata;
+  /* each batch has its own stream cursor and arena. External
+   * streams are loaded afterwards, on the calling thread. */
+  HX_Context local = *work->hx;
+  local.flags |= HX_OPEN_FLAG_LAZY_EXTERNAL;
+  arena_init(&local.arena);
+  
+  const unsigned int begin = work->first + index * work->batch_size;
+  const unsigned int end = min(begin + work->batch_size, work->first + work->count);
+  for (unsigned int i = begin; i < end; i++) {
+    HX_Entry *entry = &local.entries[i];
+    stream_seek(&local.stream, entry->_file_offset);
+    if (hx_entry_rw(&local, entry) <= 0) {
+      hx_error(&local, "failed to read entry %016llX", entry->i_cuuid);
+    }
+  }
+  
+  work->arenas[index] = local.arena;
+}
+
+/**
+ * Read `count` entries starting at `first`, whose index records are already read.
+ * Returns -1 if an external stream could not be read.
+ */
+static int hx_read_entries(HX_Context *hx, unsigned int first, unsigned int count) {
+  const unsigned int num_threads = pool_num_threads();
+  unsigned int num_batches = (count + HX_READ_BATCH_MIN_ENTRIES - 1) / HX_READ_BATCH_MIN_ENTRIES;
+  /* a few batches per thread balance entries of different sizes */
+  if (num_batches > num_threads * 4) num_batches = num_threads * 4;
+  if (num_batches == 0) return 0;
+  
+  struct hx_read_work work;
+  work.hx = hx;
+  work.first = first;
+  work.count = count;
+  work.batch_size = (count + num_batches - 1) / num_batches;
+  num_batches = (count + work.batch_size - 1) / work.batch_size;
+  
+  struct arena fallback;
+  if (!(work.arenas = malloc(sizeof(*work.arenas) * num_batches))) {
+    /* parse on the calling thread instead */
+    work.batch_size = count;
+    work.arenas = &fallback;
+    num_batches = 1;
+  }
+  
+  pool_for(num_threads, num_batches, hx_read_batch, &work);
+  
+  for (unsigned int i = 0; i < num_batches; i++) arena_merge(&hx->arena, &work.arenas[i]);
+  if (work.arenas != &fallback) free(work.arenas);
+  
+  int result = 0;
+  if (!(hx->flags & HX_OPEN_FLAG_LAZY_EXTERNAL)) {
+    for (unsigned int i = first; i < first + count; i++) {
+      HX_Entry *entry = &hx->entries[i];
+      if (entry->i_class != HX_CLASS_WAVE_FILE_ID_OBJECT || !entry->p_data) continue;
+      HX_WaveFileIdObj *data = entry->p_data;
+      if (data->_ext_stream_pending && WaveFileIdObj_LoadExternal(hx, data) != 0) result = -1;
+    }
+  }
+  
+  return result;
+}
+
 static int HX2(HX_Context *hx) {
   /* initial definitions */
   unsigned int index_offset = 0;
@@ -616,8 +999,13 @@ static int HX2(HX_Context *hx) {
   stream_t index_stream = hx->stream;
   
   if (hx->stream.mode == STREAM_MODE_WRITE) {
-    /* 255 bytes should be enough of an average size for each entry */
-    index_stream = stream_alloc(hx->num_entries * 0xFF, STREAM_MODE_WRITE, hx->stream.endianness);
+    index_stream = stream_counter(hx->stream.endianness);
+    if (!stream_counting(&hx->stream)) {
+      /* measure the index records to allocate the index at its exact size */
+      for (unsigned int i = 0; i < hx->num_entries; i++) hx_index_entry_rw(hx, &index_stream, hx->entries + i, index_type);
+      index_stream = stream_alloc(3 * 4 + index_stream.pos, STREAM_MODE_WRITE, hx->stream.endianness);
+      if (!index_stream.buf) return hx_error(hx, "failed to allocate the index");
+    }
     /* reserve space for the index offset */
     stream_advance(&hx->stream, 4);
   } else if (hx->stream.mode == STREAM_MODE_READ) {
@@ -651,86 +1039,56 @@ static int HX2(HX_Context *hx) {
     hx->entries = realloc(hx->entries, sizeof(HX_Entry) * hx->num_entries);
   }
   
+  const unsigned int first_entry = hx->num_entries - num_entries;
   while (num_entries--) {
-    HX_Size classname_length = 0;
     HX_Entry *entry = &hx->entries[hx->num_entries - num_entries - 1];
-    
-    char classname[HX_STRING_MAX_LENGTH];
-    if (index_stream.mode == STREAM_MODE_WRITE) {
-      classname_length = hx_class_name(entry->i_class, hx->version, classname, HX_STRING_MAX_LENGTH);
-    }
-    
-    stream_rw32(&index_stream, &classname_length);
-    stream_rw(&index_stream, classname, classname_length);
-    
-    if (index_stream.mode == STREAM_MODE_READ) {
-      hx_entry_init(entry);
-      entry->i_class = hx_class_from_string(classname);
+    if (hx->stream.mode == STREAM_MODE_WRITE) {
+      /* entries are written in index order */
+      entry->_file_offset = hx->stream.pos;
     }
-      
-    unsigned int zero = 0;
-    stream_rwcuuid(&index_stream, &entry->i_cuuid);
-    stream_rw32(&index_stream, &entry->_file_offset);
-    stream_rw32(&index_stream, &entry->_file_size);
-    stream_rw32(&index_stream, &zero);
-    stream_rw32(&index_stream, &entry->num_links);
     
-    assert(zero == 0);
+    hx_index_entry_rw(hx, &index_stream, entry, index_type);
     
-    if (index_type == 0x2) {
-      if (index_stream.mode == STREAM_MODE_READ) {
-        entry->links = malloc(sizeof(*entry->links) * entry->num_links);
-      }
-
-      for (int i = 0; i < entry->num_links; i++) {
-        stream_rwcuuid(&index_stream, entry->links + i);
-      }
-
-      stream_rw32(&index_stream, &entry->num_languages);
-      if (index_stream.mode == STREAM_MODE_READ) {
-        entry->language_links = malloc(sizeof(*entry->language_links) * entry->num_languages);
+    if (hx->stream.mode == STREAM_MODE_WRITE) {
+      const int entry_size = hx_entry_rw(hx, entry);
+      if (entry_size <= 0 || hx->stream.error) {
+        /* a failed sink has reported the error already */
+        if (entry_size <= 0) hx_error(hx, "failed to write entry %016llX", entry->i_cuuid);
+        stream_dealloc(&index_stream);
+        return -1;
       }
-
-      for (int i = 0; i < entry->num_languages; i++) {
-        unsigned int language_code = hx_language_to_code(entry->language_links[i].language);
-        stream_rw32(&index_stream, &language_code);
-        stream_rw32(&index_stream, &entry->language_links[i].unknown);
-        stream_rwcuuid(&index_stream, &entry->language_links[i].cuuid);
-        if (index_stream.mode == STREAM_MODE_READ)
-          entry->language_links[i].language = hx_language_from_code(language_code);
-      }
-    }
-    
-    if (hx->stream.mode == STREAM_MODE_READ) {
-      stream_seek(&hx->stream, entry->_file_offset);
-    }
-    
-    if (hx_entry_rw(hx, entry) <= 0) {
-      hx_error(hx, "failed to %s entry %016llX", index_stream.mode == STREAM_MODE_READ ? "read" : "write", entry->i_cuuid);
+      /* the size is known after the sizing pass, before the final one */
+      entry->_file_size = entry_size;
     }
   }
   
+  if (hx->stream.mode == STREAM_MODE_READ) {
+    /* the index gives the offset of every entry, so they can be read independently */
+    const int result = hx_read_entries(hx, first_entry, hx->num_entries - first_entry);
+    /* without the hash, lookups fall back to a linear search */
+    hx_index_update(hx);
+    PostRead(hx);
+    if (result != 0) return result;
+  }
+  
   if (hx->stream.mode == STREAM_MODE_WRITE) {
     /* Copy the index to the end of the file */
     unsigned int index_size = index_stream.pos;
     index_offset = hx->stream.pos;
     stream_rw(&hx->stream, index_stream.buf, index_size);
     
+    /* write info, padded to 16 bytes */
+    char info[] = "This file was written by libhx2.";
+    stream_rw(&hx->stream, info, sizeof(info) - 1);
+    stream_advance(&hx->stream, (16 - hx->stream.pos % 16) % 16);
     hx->stream.size = hx->stream.pos;
-    if (hx->version == HX_VERSION_HXG || hx->version == HX_VERSION_HX2) {
-      hx->stream.size += (8 * 4);
-      memset(hx->stream.buf + hx->stream.pos, 0, 8 * 4);
-    }
-    
-    /* write info */
-    int sz = sprintf(hx->stream.buf + hx->stream.pos, "This file was written by libhx2.");
-    sz += (16 - (hx->stream.pos + sz) % 16) % 16;
-    hx->stream.size = hx->stream.pos + sz;
-    stream_advance(&hx->stream, sz);
     
+    /* chunked streams write the index offset through to the flushed data */
+    stream_flush(&hx->stream);
     stream_seek(&hx->stream, 0);
     stream_rw32(&hx->stream, &index_offset);
     stream_dealloc(&index_stream);
+    if (hx->stream.error) return -1;
   }
 
   return 0;
@@ -741,9 +1099,42 @@ HX_Context *hx_context_alloc() {
   hx->version = HX_VERSION_INVALID;
   hx->entries = NULL;
   hx->num_entries = 0;
+  hx->flags = 0;
+  hx->release_cb = NULL;
+  hx->remove_cb = NULL;
+  hx->files = NULL;
+  hx->num_files = 0;
+  arena_init(&hx->arena);
+  hx->index_slots = NULL;
+  hx->index_capacity = 0;
+  hx->index_size = 0;
   return hx;
 }
 
+/** Release data returned by the read callback */
+static void hx_release(const HX_Context *hx, void* data, size_t size) {
+  if (hx->release_cb) {
+    hx->release_cb(data, size, hx->userdata);
+  } else {
+    free(data);
+  }
+}
+
+void hx_context_release_callback(HX_Context *hx, HX_ReleaseCallback release) {
+  hx->release_cb = release;
+}
+
+void hx_context_remove_callback(HX_Context *hx, HX_RemoveCallback remove) {
+  hx->remove_cb = remove;
+}
+
+void hx_context_io_mmap(HX_Context *hx) {
+  hx->read_cb = hx_io_mmap_read;
+  hx->write_cb = hx_io_mmap_write;
+  hx->release_cb = hx_io_mmap_release;
+  hx->remove_cb = hx_io_remove;
+}
+
 void hx_context_callback(HX_Context *hx, HX_ReadCallback read, HX_WriteCallback write, HX_ErrorCallback error, void* userdata) {
   hx->read_cb = read;
   hx->write_cb = write;
@@ -752,6 +1143,11 @@ void hx_context_callback(HX_Context *hx, HX_ReadCallback read, HX_WriteCallback
 }
 
 int hx_context_open(HX_Context *hx, const char* filename) {
+  return hx_context_open_flags(hx, filename, 0);
+}
+
+int hx_context_open_flags(HX_Context *hx, const char* filename, unsigned int flags) {
+  hx->flags = flags;
   if (!filename) {
     return hx_error(hx, "invalid filename", filename);
   }
@@ -774,32 +1170,132 @@ int hx_context_open(HX_Context *hx, const char* filename) {
   }
   
   if (hx->version == HX_VERSION_INVALID) {
+    hx_release(hx, data, size);
     return hx_error(hx, "invalid hx file version");
   }
   
   stream_t stream = stream_create(data, size, STREAM_MODE_READ, hx_version_table[hx->version].endianness);
   hx->stream = stream;
   
-  if (HX2(hx) != 0)
-    goto fail;
+  const int result = HX2(hx);
+  /* entries may borrow from the file data even if reading failed */
+  if (result != 0 && !(flags & HX_OPEN_FLAG_BORROW_INTERNAL)) {
+    hx_release(hx, data, size);
+    return -1;
+  }
+  
+  struct hx_file_data *files = realloc(hx->files, sizeof(*files) * (hx->num_files + 1));
+  if (!files) {
+    hx_release(hx, data, size);
+    return hx_error(hx, "failed to allocate file data");
+  }
+  hx->files = files;
+  hx->files[hx->num_files].data = data;
+  hx->files[hx->num_files].size = size;
+  hx->num_files++;
+  
+  return result;
+}
+
+/** Write the data of every external stream */
+static int hx_write_external_streams(HX_Context *hx) {
+  for (unsigned int i = 0; i < hx->num_entries; i++) {
+    HX_Entry *entry = hx->entries + i;
+    if (entry->i_class != HX_CLASS_WAVE_FILE_ID_OBJECT || !entry->p_data) continue;
+    HX_WaveFileIdObj *data = entry->p_data;
+    if (!(data->id_obj.flags & HX_ID_OBJ_PTR_FLAG_EXTERNAL)) continue;
+    
+    size_t sz = data->ext_stream_size;
+    hx->write_cb(data->ext_stream_filename, data->audio_stream->data, data->ext_stream_offset, &sz, hx->userdata);
+    if (sz != data->ext_stream_size) {
+      return hx_error(hx, "failed to write to external stream (%s @ 0x%X)", data->ext_stream_filename, data->ext_stream_offset);
+    }
+  }
   return 0;
-fail:
-  free(data);
+}
+
+/**
+ * Write the external streams once the .hx file was written, which fails if `result` is nonzero.
+ * On failure, the .hx file is removed if the context has a remove callback.
+ */
+static int hx_write_finish(HX_Context *hx, const char* filename, int result) {
+  if (result == 0 && hx_write_external_streams(hx) == 0) return 0;
+  if (hx->remove_cb) hx->remove_cb(filename, hx->userdata);
   return -1;
 }
 
-void hx_context_write(HX_Context *hx, const char* filename, enum HX_Version version) {
+int hx_context_write(HX_Context *hx, const char* filename, enum HX_Version version) {
   stream_t ps = hx->stream;
-  hx->stream = stream_alloc(0x4FFFFF, STREAM_MODE_WRITE, ps.endianness);
-  memset(hx->stream.buf, 0, hx->stream.size);
-  
   hx->version = version;
-  if (HX2(hx) != 0) return;
+  
+  /* the first pass only measures the file, so it can be allocated at its exact size */
+  hx->stream = stream_counter(ps.endianness);
+  if (HX2(hx) != 0) {
+    hx->stream = ps;
+    return -1;
+  }
+  
+  hx->stream = stream_alloc(hx->stream.size, STREAM_MODE_WRITE, ps.endianness);
+  if (!hx->stream.buf) {
+    hx->stream = ps;
+    return hx_error(hx, "failed to allocate %s", filename);
+  }
+  
+  if (HX2(hx) != 0) {
+    stream_dealloc(&hx->stream);
+    hx->stream = ps;
+    return -1;
+  }
   
   size_t size = hx->stream.size;
   hx->write_cb(filename, hx->stream.buf, 0, &size, hx->userdata);
+  const int result = (size == hx->stream.size) ? 0 : hx_error(hx, "failed to write %s", filename);
+  stream_dealloc(&hx->stream);
+  hx->stream = ps;
+  return hx_write_finish(hx, filename, result);
+}
+
+struct hx_write_sink {
+  HX_Context *hx;
+  const char* filename;
+  /* set once the sink was called, the file must be removed on failure */
+  int used;
+};
+
+static int hx_write_sink(const void* data, unsigned int pos, unsigned int size, void* userdata) {
+  struct hx_write_sink *sink = userdata;
+  size_t written = size;
+  sink->used = 1;
+  sink->hx->write_cb(sink->filename, (void*)data, pos, &written, sink->hx->userdata);
+  if (written != size) return hx_error(sink->hx, "failed to write %s @ 0x%X", sink->filename, pos);
+  return 0;
+}
+
+int hx_context_write_chunked(HX_Context *hx, const char* filename, enum HX_Version version, size_t chunk_size) {
+  stream_t ps = hx->stream;
+  hx->version = version;
+  
+  /* a counting pass gives the entry sizes, which the index precedes in each pass */
+  hx->stream = stream_counter(ps.endianness);
+  if (HX2(hx) != 0) {
+    hx->stream = ps;
+    return -1;
+  }
+  
+  struct hx_write_sink sink = { hx, filename, 0 };
+  hx->stream = stream_chunked(chunk_size ? chunk_size : HX_WRITE_CHUNK_SIZE, ps.endianness, hx_write_sink, &sink);
+  if (!hx->stream.buf) {
+    hx->stream = ps;
+    return hx_error(hx, "failed to allocate the write buffer");
+  }
+  
+  const int result = HX2(hx);
   stream_dealloc(&hx->stream);
   hx->stream = ps;
+  
+  /* nothing to remove if the file was not written to */
+  if (result != 0 && !sink.used) return -1;
+  return hx_write_finish(hx, filename, result);
 }
 
 void hx_context_free(HX_Context **hx) {
@@ -808,5 +1304,9 @@ void hx_context_free(HX_Context **hx) {
     hx_entry_dealloc(e);
   }
   free((*hx)->entries);
+  for (unsigned int i = 0; i < (*hx)->num_files; i++) hx_release(*hx, (*hx)->files[i].data, (*hx)->files[i].size);
+  free((*hx)->files);
+  arena_free(&(*hx)->arena);
+  free((*hx)->index_slots);
   free(*hx);
 }
@@ -24,6 +24,8 @@ typedef struct HX_Context HX_Context;
 typedef char*(*HX_ReadCallback)(const char* filename, size_t pos, size_t *size, void* userdata);
 typedef void (*HX_WriteCallback)(const char* filename, void* data, size_t pos, size_t *size, void* userdata);
 typedef void (*HX_ErrorCallback)(const char* error_str, void* userdata);
+typedef void (*HX_ReleaseCallback)(void* data, size_t size, void* userdata);
+typedef void (*HX_RemoveCallback)(const char* filename, void* userdata);
 
 enum HX_Version {
   HX_VERSION_HXD, /**< M/Arena */
@@ -97,6 +99,12 @@ typedef struct HX_AudioStream {
    * Audio data.
    */
   signed short* data;
+  
+  /* private */
+  void* _seek_table;
+  HX_ReleaseCallback _release;
+  void* _release_userdata;
+  int _borrowed;
 } HX_AudioStream;
 
 /**
@@ -105,8 +113,27 @@ typedef struct HX_AudioStream {
 const char* hx_audio_format_name(const enum HX_AudioFormat);
 
 void hx_audio_stream_init(HX_AudioStream *);
+
+/**
+ * Free the audio data. Data returned by a read callback is passed to the
+ * release callback of the context instead.
+ */
 void hx_audio_stream_dealloc(HX_AudioStream *);
 
+/**
+ * Check whether the audio data is borrowed from a context,
+ * see HX_OPEN_FLAG_BORROW_INTERNAL. Borrowed data must not be modified.
+ * @return Nonzero if the data is borrowed.
+ */
+int hx_audio_stream_borrowed(const HX_AudioStream *);
+
+/**
+ * Make the audio data writable before modifying it in place.
+ * Borrowed or mapped data is copied into a buffer owned by the stream.
+ * @return 0 on success, -1 on failure.
+ */
+int hx_audio_stream_make_writable(HX_AudioStream *);
+
 /**
  * Get the size of an audio stream.
  * @return Size of the stream in bytes.
@@ -115,8 +142,10 @@ HX_Size hx_audio_stream_size(const HX_AudioStream *);
 
 /**
  * Write audio stream to a waveformat file.
+ * The header and the samples are passed to the write callback in chunks of increasing position.
+ * Compressed streams are decoded one chunk at a time, so memory use does not depend on the stream size.
  * @param[in] stream Audio stream to be written
- * @return 1 on success.
+ * @return 0 on success, -1 on failure. Nothing is written for a stream without channels.
  */
 int hx_audio_stream_write_wav(const HX_Context *, HX_AudioStream *stream, const char* filename);
 
@@ -124,12 +153,347 @@ int hx_audio_stream_write_wav(const HX_Context *, HX_AudioStream *stream, const
  * Convert audio data.
  * The parameters of the desired output format should be set in the output stream info.
  * If the format of both the input and output stream is PCM, no conversion will be performed.
+ * Streams between two non-PCM formats are decoded to PCM and encoded again,
+ * using the codecs registered for the formats (see hx_audio_codec_register).
+ * A nonzero sample rate or channel count in the output stream info different from
+ * that of the input resamples or mixes the audio while it is decoded.
  * @param[in]     i_stream  Input audio stream
  * @param[in,out] o_stream  Output audio stream
  * @return 1 on success, 0 on encoding/decoding error, -1 on unsupported format.
  */
 int hx_audio_convert(const HX_AudioStream *i_stream, HX_AudioStream *o_stream);
 
+/**
+ * Convert audio data, decoding a single DSP or PSX stream on multiple threads.
+ * The output is identical to that of hx_audio_convert. A cached seek table
+ * (see hx_audio_stream_seek) is used for the chunk boundaries if present.
+ * @param[in]     i_stream    Input audio stream
+ * @param[in,out] o_stream    Output audio stream
+ * @param[in]     num_threads Maximum number of threads, or 0 for one per cpu
+ * @return 0 on success, -1 on failure.
+ */
+int hx_audio_convert_parallel(const HX_AudioStream *i_stream, HX_AudioStream *o_stream, unsigned int num_threads);
+
+/**
+ * Encoder search effort.
+ */
+enum HX_AudioEncodeMode {
+  HX_AUDIO_ENCODE_FAST,       /**< Estimate the encoding parameters of each frame */
+  HX_AUDIO_ENCODE_EXHAUSTIVE, /**< Try every encoding parameter of each frame */
+};
+
+/**
+ * Encode PCM audio data.
+ * hx_audio_convert encodes in fast mode.
+ * @param[in]     i_stream  Input PCM audio stream
+ * @param[in,out] o_stream  Output audio stream, with the desired format set in the stream info
+ * @param[in]     mode      Encoder search effort
+ * @return 0 on success, -1 on unsupported format.
+ */
+int hx_audio_encode(const HX_AudioStream *i_stream, HX_AudioStream *o_stream, enum HX_AudioEncodeMode mode);
+
+/** Returned by hx_audio_convert_into when the output buffer is too small */
+#define HX_AUDIO_BUFFER_TOO_SMALL (-2)
+
+/**
+ * Get the size of the buffer needed by hx_audio_convert_into, including its temporary memory.
+ * @param[in] i_stream  Input audio stream
+ * @param[in] o_stream  Output audio stream, with the desired format set in the stream info
+ * @return Size in bytes, or 0 if the conversion is not supported.
+ */
+HX_Size hx_audio_convert_size(const HX_AudioStream *i_stream, const HX_AudioStream *o_stream);
+
+/**
+ * Convert audio data into a caller-supplied buffer instead of allocating the output.
+ * Nothing is allocated: temporary memory, such as the DSP coefficient analysis or the intermediate
+ * PCM data of a conversion between two encoded formats, is taken from `buf` past the output.
+ * Resampling is not supported. The output stream data borrows `buf`, so hx_audio_stream_dealloc does not free it.
+ * @param[in]     i_stream  Input audio stream
+ * @param[in,out] o_stream  Output audio stream, with the desired format set in the stream info
+ * @param[out]    buf       Output buffer
+ * @param[in]     cap       Size of the output buffer in bytes (see hx_audio_convert_size)
+ * @return 0 on success, HX_AUDIO_BUFFER_TOO_SMALL if `cap` is too small, -1 on failure.
+ */
+int hx_audio_convert_into(const HX_AudioStream *i_stream, HX_AudioStream *o_stream, void *buf, size_t cap);
+
+typedef struct HX_AudioBatchOptions {
+  /**
+   * Maximum number of threads, or 0 for one per cpu.
+   */
+  unsigned int num_threads;
+  
+  /**
+   * Encoder search effort.
+   */
+  enum HX_AudioEncodeMode mode;
+  
+  /**
+   * Optional array receiving the result of each conversion,
+   * as returned by hx_audio_encode or hx_audio_convert.
+   */
+  int *results;
+} HX_AudioBatchOptions;
+
+/**
+ * Convert multiple audio streams on a thread pool.
+ * The largest streams are started first, so that one long conversion does not run alone at the end.
+ * A NULL stream, or a stream without data such as an external stream that was not read yet, fails with -1.
+ * Use hx_context_convert_batch to convert the streams of context entries.
+ * @param[in]     i_streams  Input audio streams
+ * @param[in,out] o_streams  Output audio streams, with the desired format set in the stream info
+ * @param[in]     count      Number of streams
+ * @param[in]     opts       Options, or NULL for the defaults
+ * @return 0 if every conversion succeeded, -1 otherwise.
+ */
+int hx_audio_convert_batch(const HX_AudioStream **i_streams, HX_AudioStream **o_streams, HX_Size count, const HX_AudioBatchOptions *opts);
+
+/** Incremental audio decoder handle */
+typedef struct HX_AudioDecoder HX_AudioDecoder;
+
+/** Sample layout of hx_audio_decoder_read_samples */
+enum HX_SampleFormat {
+  /** Interleaved signed 16-bit */
+  HX_SAMPLE_FORMAT_S16,
+  /** Planar signed 16-bit */
+  HX_SAMPLE_FORMAT_S16_PLANAR,
+  /** Interleaved 32-bit float in [-1, 1) */
+  HX_SAMPLE_FORMAT_F32,
+  /** Planar 32-bit float in [-1, 1) */
+  HX_SAMPLE_FORMAT_F32_PLANAR,
+};
+
+/**
+ * Create an incremental PCM decoder for an audio stream.
+ * The stream data must remain valid while the decoder is in use.
+ * @param[in] stream Input audio stream
+ * @return Handle to the new decoder or NULL if the stream format is not supported.
+ */
+HX_AudioDecoder *hx_audio_decoder_alloc(const HX_AudioStream *stream);
+
+/**
+ * Get the info of the decoded PCM stream.
+ */
+const struct HX_AudioStreamInfo *hx_audio_decoder_info(const HX_AudioDecoder *);
+
+/**
+ * Decode the next samples of a stream into an interleaved PCM s16 buffer.
+ * @param[out] buf          Buffer of at least `num_samples * num_channels` samples
+ * @param[in]  num_samples  Number of samples per channel to decode
+ * @return The number of samples per channel written, 0 at the end of the stream, -1 on decoding error.
+ */
+int hx_audio_decoder_read(HX_AudioDecoder *, signed short *buf, HX_Size num_samples);
+
+/**
+ * Set the sample format of hx_audio_decoder_read_samples. The default is HX_SAMPLE_FORMAT_S16.
+ * @return 0 on success, -1 if the format is invalid.
+ */
+int hx_audio_decoder_set_sample_format(HX_AudioDecoder *, enum HX_SampleFormat format);
+
+/**
+ * Decode the next samples of a stream in the format set by hx_audio_decoder_set_sample_format.
+ * In planar formats channel `c` is stored at `c * num_samples` in the buffer.
+ * @param[out] buf          Buffer of at least `num_samples * num_channels` samples
+ * @param[in]  num_samples  Number of samples per channel to decode
+ * @return The number of samples per channel written, 0 at the end of the stream, -1 on decoding error.
+ */
+int hx_audio_decoder_read_samples(HX_AudioDecoder *, void *buf, HX_Size num_samples);
+
+/**
+ * Seek a decoder to a sample.
+ * A table of the predictor state before every frame is built on the first seek and cached in the stream,
+ * after which a seek decodes at most one frame. Decoders of the same stream may seek concurrently,
+ * but the stream must not be converted, modified or deallocated meanwhile.
+ * @param[in,out] stream  The stream the decoder was created from
+ * @param[in]     sample  Sample position (per channel)
+ * @return 0 on success, -1 on failure.
+ */
+int hx_audio_stream_seek(HX_AudioStream *stream, HX_AudioDecoder *, HX_Size sample);
+
+/**
+ * Enable or disable looping. A looping decoder continues at the loop start
+ * after reaching the loop end, so it never reaches the end of the stream.
+ * The predictor state at the loop start is restored without decoding the
+ * stream again. Loop points are read from the DSP header or the PSX frame flags.
+ * @param[in] loop  Nonzero to enable looping
+ * @return 0 on success, -1 if the stream has no loop.
+ */
+int hx_audio_decoder_set_loop(HX_AudioDecoder *, int loop);
+
+/**
+ * Get the loop region of the stream.
+ * @param[out] start  First sample of the loop (per channel)
+ * @param[out] end    Sample after the last sample of the loop (per channel)
+ * @return 0 on success, -1 if the stream has no loop.
+ */
+int hx_audio_decoder_loop_points(const HX_AudioDecoder *, HX_Size *start, HX_Size *end);
+
+/**
+ * Free a decoder.
+ */
+void hx_audio_decoder_free(HX_AudioDecoder **);
+
+/** Cache of converted audio streams */
+typedef struct HX_AudioCache HX_AudioCache;
+
+typedef struct HX_AudioCacheStats {
+  /**
+   * Number of lookups that found or had to convert a stream.
+   */
+  unsigned long long hits, misses;
+  
+  /**
+   * Number of streams evicted to stay within the budget.
+   */
+  unsigned long long evictions;
+  
+  /**
+   * Size of the cached data, in bytes.
+   */
+  size_t size;
+  
+  /**
+   * Number of cached streams.
+   */
+  HX_Size num_entries;
+} HX_AudioCacheStats;
+
+/**
+ * Create a cache of converted audio streams, keyed by wavefile CUUID and output format.
+ * Unpinned streams are evicted in CLOCK order once the cached data exceeds the budget.
+ * The cache is thread-safe and may be shared between contexts.
+ * @param[in] budget Maximum size of the cached data, in bytes
+ */
+HX_AudioCache *hx_audio_cache_alloc(size_t budget);
+
+/**
+ * Change the budget of a cache, evicting streams if necessary.
+ */
+void hx_audio_cache_set_budget(HX_AudioCache *, size_t budget);
+
+/**
+ * Get a stream converted to the format set in `out_info`, converting it on a miss.
+ * The returned stream is pinned: it stays valid and is not evicted until released.
+ * A zero sample rate or channel count in `out_info` keeps that of the input.
+ * @param[in] stream    Input stream, with a nonzero wavefile CUUID
+ * @param[in] out_info  Output format
+ * @return The converted stream, or NULL on failure.
+ */
+const HX_AudioStream *hx_audio_cache_acquire(HX_AudioCache *, const HX_AudioStream *stream, const struct HX_AudioStreamInfo *out_info);
+
+/**
+ * Unpin a stream returned by hx_audio_cache_acquire.
+ */
+void hx_audio_cache_release(HX_AudioCache *, const HX_AudioStream *stream);
+
+/**
+ * Get the hit/miss counters and the current size of a cache.
+ */
+void hx_audio_cache_stats(HX_AudioCache *, HX_AudioCacheStats *stats);
+
+/**
+ * Evict all unpinned streams.
+ */
+void hx_audio_cache_clear(HX_AudioCache *);
+
+/**
+ * Free a cache and all its streams. No stream may be pinned.
+ */
+void hx_audio_cache_free(HX_AudioCache **);
+
+/** SIMD kernels provided by a codec */
+enum HX_AudioCodecFlags {
+  HX_AUDIO_CODEC_SSE2  = 1 << 0,
+  HX_AUDIO_CODEC_SSSE3 = 1 << 1,
+  HX_AUDIO_CODEC_AVX2  = 1 << 2,
+};
+
+typedef struct HX_AudioCodec {
+  /**
+   * Audio format handled by the codec.
+   */
+  enum HX_AudioFormat fmt;
+  
+  /**
+   * Name of the codec.
+   */
+  const char* name;
+  
+  /**
+   * Frame geometry: samples and bytes per channel in a frame.
+   */
+  unsigned int samples_per_frame;
+  unsigned int bytes_per_frame;
+  
+  /**
+   * SIMD kernels the codec provides (HX_AUDIO_CODEC_*). The ones
+   * actually used are selected at runtime from the cpu features.
+   */
+  unsigned int simd;
+  
+  /**
+   * Decode a stream to PCM. NULL if decoding is not supported.
+   */
+  int (*decode)(const HX_AudioStream *i_stream, HX_AudioStream *o_stream);
+  
+  /**
+   * Encode a PCM stream. NULL if encoding is not supported.
+   */
+  int (*encode)(const HX_AudioStream *i_stream, HX_AudioStream *o_stream, enum HX_AudioEncodeMode mode);
+  
+  /**
+   * Size of a stream once decoded to PCM, in bytes.
+   */
+  HX_Size (*pcm_size)(const HX_AudioStream *stream);
+  
+  /**
+   * Size of a PCM stream once encoded, in bytes.
+   */
+  HX_Size (*encoded_size)(const HX_AudioStream *stream);
+  
+  /**
+   * Decode or encode into a caller-supplied buffer of `cap` bytes, returning
+   * HX_AUDIO_BUFFER_TOO_SMALL instead of allocating. NULL if not supported.
+   */
+  int (*decode_into)(const HX_AudioStream *i_stream, HX_AudioStream *o_stream, void *buf, HX_Size cap);
+  int (*encode_into)(const HX_AudioStream *i_stream, HX_AudioStream *o_stream, enum HX_AudioEncodeMode mode, void *buf, HX_Size cap);
+  
+  /**
+   * Temporary memory needed by encode_into on top of the encoded size, in bytes.
+   * It is taken from the caller-supplied buffer past the output. NULL if none is needed.
+   */
+  HX_Size (*encode_scratch_size)(const HX_AudioStream *stream);
+  
+  /**
+   * Measure throughput in samples per second. If NULL,
+   * hx_audio_codec_benchmark times the encode and decode functions.
+   */
+  int (*benchmark)(HX_Size num_samples, double *decode_rate, double *encode_rate);
+} HX_AudioCodec;
+
+/**
+ * Register a codec, replacing any codec registered for the same format.
+ * Registration is not thread-safe and should be done at startup.
+ * @param[in] codec The codec, which is copied
+ * @return 0 on success, -1 if the registry is full.
+ */
+int hx_audio_codec_register(const HX_AudioCodec *codec);
+
+/**
+ * Find the codec registered for a format.
+ * @return The codec or NULL if the format is not supported.
+ */
+const HX_AudioCodec *hx_audio_codec_find(enum HX_AudioFormat fmt);
+
+/**
+ * Measure the throughput of a codec on a synthetic mono signal.
+ * A rate is set to 0 if the codec does not support the operation.
+ * @param[in]  num_samples  Length of the test signal
+ * @param[out] decode_rate  Decoded samples per second
+ * @param[out] encode_rate  Encoded samples per second
+ * @return 0 on success, -1 on failure.
+ */
+int hx_audio_codec_benchmark(enum HX_AudioFormat fmt, HX_Size num_samples, double *decode_rate, double *encode_rate);
+
 
 #pragma mark - Class -
 
@@ -260,6 +624,7 @@ typedef struct WaveFileIdObj {
   void* _wave_header;
   void* _extra_wave_data;
   HX_Size _extra_wave_data_length;
+  int _ext_stream_pending;
 } HX_WaveFileIdObj;
 
 /**
@@ -319,6 +684,8 @@ typedef struct HX_Entry {
   HX_Size _file_offset;
   HX_Size _file_size;
   HX_Size _tmp_file_size;
+  /* metadata is owned by the context arena */
+  int _arena;
 } HX_Entry;
 
 void hx_entry_init(HX_Entry *);
@@ -341,6 +708,47 @@ HX_Context *hx_context_alloc(void);
  */
 void hx_context_callback(HX_Context *, HX_ReadCallback read, HX_WriteCallback write, HX_ErrorCallback error, void* userdata);
 
+/**
+ * Set the callback that releases data returned by the read callback.
+ * Without it, the data is passed to free().
+ * @param[in] release Release callback
+ */
+void hx_context_release_callback(HX_Context *, HX_ReleaseCallback release);
+
+/**
+ * Set the callback that removes a partially written .hx file when writing fails.
+ * Without it, the partial file is left in place.
+ * @param[in] remove Remove callback
+ */
+void hx_context_remove_callback(HX_Context *, HX_RemoveCallback remove);
+
+/**
+ * Read callback that maps files read-only instead of copying them.
+ * Pages are loaded on first access. Must be paired with hx_io_mmap_release.
+ */
+char* hx_io_mmap_read(const char* filename, size_t pos, size_t *size, void* userdata);
+
+/**
+ * Write callback for use with hx_io_mmap_read, writing with pwrite.
+ * Existing files are not truncated.
+ */
+void hx_io_mmap_write(const char* filename, void* data, size_t pos, size_t *size, void* userdata);
+
+/**
+ * Release callback that unmaps data returned by hx_io_mmap_read.
+ */
+void hx_io_mmap_release(void* data, size_t size, void* userdata);
+
+/**
+ * Remove callback that unlinks the file.
+ */
+void hx_io_remove(const char* filename, void* userdata);
+
+/**
+ * Use the hx_io_mmap_* and hx_io_remove callbacks for file i/o, keeping the error callback and userdata.
+ */
+void hx_context_io_mmap(HX_Context *);
+
 /**
  * Load a .hx file.
  * @param[in] filename Filename with extension
@@ -348,6 +756,38 @@ void hx_context_callback(HX_Context *, HX_ReadCallback read, HX_WriteCallback wr
  */
 int hx_context_open(HX_Context *, const char* filename);
 
+/** Defer reading external streams until hx_context_audio_stream is called */
+#define HX_OPEN_FLAG_LAZY_EXTERNAL (1 << 0)
+/** Point internal audio data into the file data instead of copying it */
+#define HX_OPEN_FLAG_BORROW_INTERNAL (1 << 1)
+
+/**
+ * Load a .hx file with open flags.
+ * @param[in] filename Filename with extension
+ * @param[in] flags    HX_OPEN_FLAG_* flags
+ * @return 0 on success, -1 on failure.
+ */
+int hx_context_open_flags(HX_Context *, const char* filename, unsigned int flags);
+
+/**
+ * Get the audio stream of a WaveFileIdObj entry.
+ * An external stream deferred by HX_OPEN_FLAG_LAZY_EXTERNAL is read on the first call,
+ * so the read callback must remain valid until then.
+ * @return The audio stream, or NULL if the external stream could not be read.
+ */
+HX_AudioStream *hx_context_audio_stream(const HX_Context *, HX_WaveFileIdObj *);
+
+/**
+ * Convert the audio streams of multiple WaveFileIdObj entries on a thread pool (see hx_audio_convert_batch).
+ * Deferred external streams are read first, on the calling thread. A stream that cannot be read fails with -1.
+ * @param[in]     objs   WaveFileIdObj entries
+ * @param[in,out] out    Output audio streams, with the desired format set in the stream info
+ * @param[in]     count  Number of entries
+ * @param[in]     opts   Options, or NULL for the defaults
+ * @return 0 if every stream was read and converted, -1 otherwise.
+ */
+int hx_context_convert_batch(const HX_Context *, HX_WaveFileIdObj **objs, HX_AudioStream **out, HX_Size count, const HX_AudioBatchOptions *opts);
+
 /**
  * Get current context version.
  */
@@ -375,10 +815,29 @@ HX_Entry *hx_context_find_entry(const HX_Context *, HX_CUUID cuuid);
 
 /**
  * Write context and resources to files.
+ * External stream data is written once the .hx file is complete. If anything fails, including
+ * reading a deferred external stream, the .hx file is removed (see hx_context_remove_callback).
+ * External stream files may then be partially written.
  * @param[in] filename  Name of the .hx output file
  * @param[in] version   Desired version of the output context
+ * @return 0 on success, -1 on failure.
+ */
+int hx_context_write(HX_Context *, const char* filename, enum HX_Version version);
+
+/** Default chunk size of hx_context_write_chunked */
+#define HX_WRITE_CHUNK_SIZE 0x100000
+
+/**
+ * Write context and resources to files, passing the .hx file to the write
+ * callback in chunks at increasing positions instead of building it in memory.
+ * The index offset at position 0 is written last, so the callback must support
+ * writing to an earlier position. Failures are handled as in hx_context_write.
+ * @param[in] filename    Name of the .hx output file
+ * @param[in] version     Desired version of the output context
+ * @param[in] chunk_size  Size of each chunk, or 0 for HX_WRITE_CHUNK_SIZE
+ * @return 0 on success, -1 on failure.
  */
-void hx_context_write(HX_Context *, const char* filename, enum HX_Version version);
+int hx_context_write_chunked(HX_Context *, const char* filename, enum HX_Version version, size_t chunk_size);
 
 /**
  * Free context data and all entries.
@@ -0,0 +1,70 @@
+/*****************************************************************
+ # io.c: Memory-mapped file i/o
+ *****************************************************************
+ * libhx2: library for reading and writing .hx audio files
+ * Copyright (c) 2024 Jba03 <jba03@jba03.xyz>
+ *****************************************************************/
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hx2.h"
+
+static size_t io_page_size(void) {
+  long n = sysconf(_SC_PAGESIZE);
+  return (n > 0) ? (size_t)n : 4096;
+}
+
+char* hx_io_mmap_read(const char* filename, size_t pos, size_t *size, void* userdata) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  
+  struct stat st;
+  if (fstat(fd, &st) != 0 || pos > (size_t)st.st_size) {
+    close(fd);
+    return NULL;
+  }
+  
+  if (*size > (size_t)st.st_size - pos) *size = (size_t)st.st_size - pos;
+  
+  /* mappings start on a page boundary */
+  const size_t offset = pos % io_page_size();
+  const size_t length = offset + *size;
+  void* map = mmap(NULL, length ? length : 1, PROT_READ, MAP_PRIVATE, fd, (off_t)(pos - offset));
+  close(fd);
+  
+  return (map == MAP_FAILED) ? NULL : (char*)map + offset;
+}
+
+void hx_io_mmap_write(const char* filename, void* data, size_t pos, size_t *size, void* userdata) {
+  int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    *size = 0;
+    return;
+  }
+  
+  size_t written = 0;
+  while (written < *size) {
+    ssize_t n = pwrite(fd, (const char*)data + written, *size - written, (off_t)(pos + written));
+    if (n <= 0) break;
+    written += n;
+  }
+  
+  close(fd);
+  *size = written;
+}
+
+void hx_io_mmap_release(void* data, size_t size, void* userdata) {
+  if (!data) return;
+  /* recover the page-aligned start of the mapping */
+  const size_t offset = (uintptr_t)data % io_page_size();
+  const size_t length = offset + size;
+  munmap((char*)data - offset, length ? length : 1);
+}
+
+void hx_io_remove(const char* filename, void* userdata) {
+  unlink(filename);
+}
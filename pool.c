@@ -0,0 +1,52 @@
+/*****************************************************************
+ # pool.c: Thread pool
+ *****************************************************************
+ * libhx2: library for reading and writing .hx audio files
+ * Copyright (c) 2024 Jba03 <jba03@jba03.xyz>
+ *****************************************************************/
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define POOL_MAX_THREADS 64
+
+struct pool_work {
+  pool_task_t task;
+  void* userdata;
+  unsigned int count;
+  unsigned int next;
+};
+
+static void* pool_worker(void* p) {
+  struct pool_work *work = p;
+  unsigned int index;
+  while ((index = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->count) {
+    work->task(index, work->userdata);
+  }
+  return NULL;
+}
+
+unsigned int pool_num_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (unsigned int)n : 1;
+}
+
+void pool_for(unsigned int num_threads, unsigned int count, pool_task_t task, void* userdata) {
+  struct pool_work work = { .task = task, .userdata = userdata, .count = count, .next = 0 };
+  pthread_t threads[POOL_MAX_THREADS];
+  unsigned int num_started = 0;
+  
+  if (num_threads > count) num_threads = count;
+  if (num_threads > POOL_MAX_THREADS) num_threads = POOL_MAX_THREADS;
+  
+  /* the calling thread is the first worker */
+  while (num_started + 1 < num_threads) {
+    if (pthread_create(&threads[num_started], NULL, pool_worker, &work) != 0) break;
+    num_started++;
+  }
+  
+  pool_worker(&work);
+  for (unsigned int i = 0; i < num_started; i++) pthread_join(threads[i], NULL);
+}
@@ -0,0 +1,23 @@
+/*****************************************************************
+ # pool.h: Thread pool
+ *****************************************************************
+ * libhx2: library for reading and writing .hx audio files
+ * Copyright (c) 2024 Jba03 <jba03@jba03.xyz>
+ *****************************************************************/
+
+#ifndef pool_h
+#define pool_h
+
+typedef void (*pool_task_t)(unsigned int index, void* userdata);
+
+/** pool_num_threads:
+ * Number of hardware threads. */
+unsigned int pool_num_threads(void);
+
+/** pool_for:
+ * Run `task` for every index in [0, count) on up to `num_threads` threads,
+ * including the calling thread. Indices are handed out in increasing order.
+ * Returns when all tasks have completed. */
+void pool_for(unsigned int num_threads, unsigned int count, pool_task_t task, void* userdata);
+
+#endif /* pool_h */
@@ -11,12 +11,69 @@ stream_t stream_create(void* data, unsigned int size, unsigned char mode, unsign
   return (stream_t){ .buf = data, .size = size, .pos = 0, .mode = mode, .endianness = endianness };
 }
 
+/** A zero-filled stream, its buffer is NULL if out of memory */
 stream_t stream_alloc(unsigned int size, unsigned char mode, unsigned char endianness) {
-  stream_t s = stream_create(malloc(size), size, mode, endianness);
-  memset(s.buf, 0, size);
+  return stream_create(calloc(size ? size : 1, 1), size, mode, endianness);
+}
+
+/** A write stream without a buffer, which only measures the size of what is written */
+stream_t stream_counter(unsigned char endianness) {
+  return stream_create(NULL, 0, STREAM_MODE_WRITE, endianness);
+}
+
+int stream_counting(const stream_t *s) {
+  return s->mode == STREAM_MODE_WRITE && !s->buf;
+}
+
+/** A write stream that passes its data to the sink in chunks of `capacity` bytes */
+stream_t stream_chunked(unsigned int capacity, unsigned char endianness, stream_sink_t sink, void* userdata) {
+  stream_t s = stream_alloc(capacity, STREAM_MODE_WRITE, endianness);
+  s.sink = sink;
+  s.sink_userdata = userdata;
+  s.capacity = capacity;
   return s;
 }
 
+/** Pass the buffered data up to the current position to the sink. Returns -1 if the sink has failed. */
+int stream_flush(stream_t *s) {
+  if (!s->sink) return 0;
+  while (s->pos > s->base) {
+    const unsigned int n = (s->pos - s->base < s->capacity) ? s->pos - s->base : s->capacity;
+    if (!s->error && s->sink(s->buf, s->base, n, s->sink_userdata) != 0) s->error = 1;
+    memset(s->buf, 0, n);
+    s->base += n;
+  }
+  return s->error ? -1 : 0;
+}
+
+static void stream_write_chunked(stream_t *s, const char* data, unsigned int size) {
+  /* regions that were already flushed are written through */
+  if (s->pos < s->base) {
+    const unsigned int n = (s->base - s->pos < size) ? s->base - s->pos : size;
+    if (!s->error && s->sink(data, s->pos, n, s->sink_userdata) != 0) s->error = 1;
+    data += n;
+    size -= n;
+    s->pos += n;
+  }
+  
+  while (size > 0) {
+    if (s->pos - s->base >= s->capacity) {
+      /* flush the full buffer, keeping the position */
+      const unsigned int pos = s->pos;
+      s->pos = s->base + s->capacity;
+      stream_flush(s);
+      s->pos = pos;
+      continue;
+    }
+    const unsigned int offset = s->pos - s->base;
+    const unsigned int n = (s->capacity - offset < size) ? s->capacity - offset : size;
+    memcpy(s->buf + offset, data, n);
+    data += n;
+    size -= n;
+    s->pos += n;
+  }
+}
+
 static unsigned char doswap(stream_t *s, unsigned char mode) {
   return (s->endianness != HX_NATIVE_ENDIAN) && (s->mode == mode);
 }
@@ -30,8 +87,12 @@ void stream_advance(stream_t *s, signed int offset) {
 }
 
 void stream_rw(stream_t *s, void* data, unsigned int size) {
+  if (s->mode == STREAM_MODE_WRITE && s->sink) {
+    stream_write_chunked(s, data, size);
+    return;
+  }
   if (s->mode == STREAM_MODE_READ) memcpy(data, s->buf + s->pos, size);
-  if (s->mode == STREAM_MODE_WRITE) memcpy(s->buf + s->pos, data, size);
+  if (s->mode == STREAM_MODE_WRITE && s->buf) memcpy(s->buf + s->pos, data, size);
   stream_advance(s, size);
 }
 
@@ -21,16 +21,31 @@
 #define STREAM_MODE_READ 0
 #define STREAM_MODE_WRITE 1
 
+/* Returns 0 on success, -1 on failure */
+typedef int (*stream_sink_t)(const void* data, unsigned int pos, unsigned int size, void* userdata);
+
 typedef struct stream {
   unsigned char mode;
   unsigned int size;
   unsigned int pos;
   unsigned char endianness;
   char* buf;
+  /* Chunked write streams pass the buffer to the sink when
+   * it is full. Data before `base` has already been passed. */
+  stream_sink_t sink;
+  void* sink_userdata;
+  unsigned int base;
+  unsigned int capacity;
+  /* Set when the sink fails, nothing is passed to it afterwards */
+  int error;
 } stream_t;
 
 stream_t stream_create(void* data, unsigned int size, unsigned char mode, unsigned char endianness);
 stream_t stream_alloc(unsigned int size, unsigned char mode, unsigned char endianness);
+stream_t stream_counter(unsigned char endianness);
+stream_t stream_chunked(unsigned int capacity, unsigned char endianness, stream_sink_t sink, void* userdata);
+int stream_flush(stream_t *s);
+int stream_counting(const stream_t *s);
 void stream_seek(stream_t *s, unsigned int pos);
 void stream_advance(stream_t *s, signed int offset);
 void stream_rw(stream_t *s, void* data, unsigned int size);
@@ -0,0 +1,225 @@
+/*****************************************************************
+ # kernels.c: Compare the SIMD frame decoders to the scalar ones
+ *****************************************************************
+ * libhx2: library for reading and writing .hx audio files
+ * Copyright (c) 2024 Jba03 <jba03@jba03.xyz>
+ *****************************************************************/
+
+/* the frame decoders are internal, so build the test in the library translation unit */
+#include "../hx2.c"
+
+#define RANDOM_FRAMES 100000
+#define OUTPUT_SENTINEL 0x5A5A
+
+static unsigned int random_state = 0x2545F491;
+
+/** Deterministic xorshift, so that failures can be reproduced */
+static unsigned int random_next(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+static void random_bytes(unsigned char *dst, unsigned int n) {
+  for (unsigned int i = 0; i < n; i++) dst[i] = random_next() & 0xFF;
+}
+
+/** Extreme predictor history and coefficient values */
+static const signed short edge_values[] = { 0, 1, -1, SHRT_MAX, SHRT_MIN };
+/** Data bytes covering the nibble extremes (0, 7, -8, -1) */
+static const unsigned char edge_bytes[] = { 0x00, 0x77, 0x88, 0xFF, 0x78, 0x87, 0x0F, 0xF0 };
+
+#define countof(a) (sizeof(a) / sizeof(*(a)))
+
+/**
+ * Output of a single frame: the stereo interleaved s16 and f32 outputs, of which
+ * only the first channel is written. The second channel must be left untouched.
+ */
+struct frame_output {
+  signed short s16[32 * 2];
+  float f32[32 * 2];
+};
+
+static void frame_output_clear(struct frame_output *o) {
+  for (unsigned int i = 0; i < countof(o->s16); i++) o->s16[i] = OUTPUT_SENTINEL;
+  for (unsigned int i = 0; i < countof(o->f32); i++) o->f32[i] = OUTPUT_SENTINEL;
+}
+
+static struct audio_output frame_output_s16(struct frame_output *o) {
+  return (struct audio_output){ o->s16, 2, 1, 0 };
+}
+
+static struct audio_output frame_output_f32(struct frame_output *o) {
+  return (struct audio_output){ o->f32, 2, 1, 1 };
+}
+
+static int failures = 0;
+
+static void report(const char *codec, const char *kernel, const unsigned char *frame, unsigned int frame_size, const char *what) {
+  if (failures++ >= 10) return;
+  fprintf(stderr, "%s %s: %s differs for frame", codec, kernel, what);
+  for (unsigned int i = 0; i < frame_size; i++) fprintf(stderr, " %02X", frame[i]);
+  fprintf(stderr, "\n");
+}
+
+#pragma mark - DSP
+
+struct dsp_kernel {
+  const char *name;
+  unsigned int features;
+  dsp_frame_decoder decode;
+};
+
+static const struct dsp_kernel dsp_kernels[] = {
+#if HX_X86
+  { "sse2", HX_CPU_SSE2, dsp_frame_decode_sse2 },
+  { "ssse3", HX_CPU_SSSE3, dsp_frame_decode_ssse3 },
+  { "avx2", HX_CPU_AVX2, dsp_frame_decode_avx2 },
+#endif
+  { NULL, 0, NULL },
+};
+
+/** Decode `frame` with the scalar decoder and every supported kernel, then compare the results */
+static void dsp_compare(const unsigned char *frame, const struct dsp_adpcm *state, int count) {
+  struct dsp_adpcm expected_state[2] = { *state, *state };
+  struct frame_output expected;
+  frame_output_clear(&expected);
+  struct audio_output out = frame_output_s16(&expected);
+  dsp_frame_decode_scalar(frame, &expected_state[0], &out, count);
+  out = frame_output_f32(&expected);
+  dsp_frame_decode_scalar(frame, &expected_state[1], &out, count);
+  
+  for (const struct dsp_kernel *k = dsp_kernels; k->name; k++) {
+    if ((hx_cpu_features() & k->features) != k->features) continue;
+    struct dsp_adpcm result_state[2] = { *state, *state };
+    struct frame_output result;
+    frame_output_clear(&result);
+    out = frame_output_s16(&result);
+    k->decode(frame, &result_state[0], &out, count);
+    out = frame_output_f32(&result);
+    k->decode(frame, &result_state[1], &out, count);
+    
+    if (memcmp(expected.s16, result.s16, sizeof(result.s16))) report("dsp", k->name, frame, DSP_BYTES_PER_FRAME, "s16 output");
+    if (memcmp(expected.f32, result.f32, sizeof(result.f32))) report("dsp", k->name, frame, DSP_BYTES_PER_FRAME, "f32 output");
+    for (int i = 0; i < 2; i++) {
+      if (expected_state[i].history1 != result_state[i].history1 || expected_state[i].history2 != result_state[i].history2) {
+        report("dsp", k->name, frame, DSP_BYTES_PER_FRAME, "history");
+      }
+    }
+  }
+}
+
+static void dsp_test(void) {
+  unsigned char frame[DSP_BYTES_PER_FRAME];
+  struct dsp_adpcm state;
+  memset(&state, 0, sizeof(state));
+  
+  /* every header byte, with extreme nibbles, coefficients and history */
+  for (int header = 0; header < 256; header++) {
+    for (unsigned int b = 0; b < countof(edge_bytes); b++) {
+      for (unsigned int v = 0; v < countof(edge_values); v++) {
+        frame[0] = header;
+        memset(frame + 1, edge_bytes[b], DSP_BYTES_PER_FRAME - 1);
+        for (int i = 0; i < 16; i++) state.c[i] = edge_values[(v + i) % countof(edge_values)];
+        state.history1 = edge_values[v];
+        state.history2 = edge_values[countof(edge_values) - 1 - v];
+        dsp_compare(frame, &state, DSP_SAMPLES_PER_FRAME);
+      }
+    }
+  }
+  
+  for (int i = 0; i < RANDOM_FRAMES; i++) {
+    random_bytes(frame, sizeof(frame));
+    for (int c = 0; c < 16; c++) state.c[c] = (signed short)random_next();
+    state.history1 = (signed short)random_next();
+    state.history2 = (signed short)random_next();
+    /* the last frame of a stream may be partial */
+    dsp_compare(frame, &state, 1 + random_next() % DSP_SAMPLES_PER_FRAME);
+  }
+}
+
+#pragma mark - PSX
+
+struct psx_kernel {
+  const char *name;
+  unsigned int features;
+  psx_frame_decoder decode;
+};
+
+static const struct psx_kernel psx_kernels[] = {
+#if HX_X86
+  { "sse2", HX_CPU_SSE2, psx_frame_decode_sse2 },
+  { "avx2", HX_CPU_AVX2, psx_frame_decode_avx2 },
+#endif
+  { NULL, 0, NULL },
+};
+
+static void psx_compare(const unsigned char *frame, const struct psx_adpcm *state) {
+  struct psx_adpcm expected_state[2] = { *state, *state };
+  struct frame_output expected;
+  frame_output_clear(&expected);
+  struct audio_output out = frame_output_s16(&expected);
+  const int expected_result = psx_frame_decode_scalar(frame, &expected_state[0], &out);
+  out = frame_output_f32(&expected);
+  psx_frame_decode_scalar(frame, &expected_state[1], &out);
+  
+  for (const struct psx_kernel *k = psx_kernels; k->name; k++) {
+    if ((hx_cpu_features() & k->features) != k->features) continue;
+    struct psx_adpcm result_state[2] = { *state, *state };
+    struct frame_output result;
+    frame_output_clear(&result);
+    out = frame_output_s16(&result);
+    const int r = k->decode(frame, &result_state[0], &out);
+    out = frame_output_f32(&result);
+    k->decode(frame, &result_state[1], &out);
+    
+    if (r != expected_result) report("psx", k->name, frame, PSX_BYTES_PER_FRAME, "result");
+    if (memcmp(expected.s16, result.s16, sizeof(result.s16))) report("psx", k->name, frame, PSX_BYTES_PER_FRAME, "s16 output");
+    if (memcmp(expected.f32, result.f32, sizeof(result.f32))) report("psx", k->name, frame, PSX_BYTES_PER_FRAME, "f32 output");
+    if (memcmp(expected_state, result_state, sizeof(result_state))) report("psx", k->name, frame, PSX_BYTES_PER_FRAME, "history");
+  }
+}
+
+static void psx_test(void) {
+  unsigned char frame[PSX_BYTES_PER_FRAME];
+  struct psx_adpcm state;
+  
+  /* every header byte, including the invalid filters, with extreme nibbles and history */
+  for (int header = 0; header < 256; header++) {
+    for (unsigned int b = 0; b < countof(edge_bytes); b++) {
+      for (unsigned int v = 0; v < countof(edge_values); v++) {
+        frame[0] = header;
+        frame[1] = 0;
+        memset(frame + 2, edge_bytes[b], PSX_BYTES_PER_FRAME - 2);
+        state.history1 = edge_values[v];
+        state.history2 = edge_values[countof(edge_values) - 1 - v];
+        psx_compare(frame, &state);
+      }
+    }
+  }
+  
+  for (int i = 0; i < RANDOM_FRAMES; i++) {
+    random_bytes(frame, sizeof(frame));
+    /* mostly valid filters */
+    if (i % 8) frame[0] = (frame[0] & 0x0F) | ((random_next() % 5) << 4);
+    state.history1 = (signed short)random_next();
+    state.history2 = (signed short)random_next();
+    psx_compare(frame, &state);
+  }
+}
+
+int main(int argc, char **argv) {
+  const unsigned int features = hx_cpu_features();
+  printf("kernels:");
+  for (const struct dsp_kernel *k = dsp_kernels; k->name; k++) {
+    if ((features & k->features) == k->features) printf(" %s", k->name);
+  }
+  printf("\n");
+  
+  dsp_test();
+  psx_test();
+  
+  if (failures) fprintf(stderr, "%d mismatches\n", failures);
+  return failures ? 1 : 0;
+}